@@ -0,0 +1,123 @@
+// linked into beatstep-bench only: counts every heap allocation, on every thread, so bench can show
+// the read/write path (the caller, the dispatcher & the I/O thread) doesn't make any
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+std::atomic<unsigned long> beatstepAllocations{0};
+
+static void *beatstepAllocate (size_t size) {
+  beatstepAllocations.fetch_add(1, std::memory_order_relaxed);
+  return malloc(size ? size : 1);
+}
+
+void *operator new (size_t size) {
+  void *p = beatstepAllocate(size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[] (size_t size) {
+  return operator new(size);
+}
+
+void *operator new (size_t size, const std::nothrow_t &) noexcept {
+  return beatstepAllocate(size);
+}
+
+void *operator new[] (size_t size, const std::nothrow_t &) noexcept {
+  return beatstepAllocate(size);
+}
+
+void operator delete (void *p) noexcept {
+  free(p);
+}
+
+void operator delete[] (void *p) noexcept {
+  free(p);
+}
+
+void operator delete (void *p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete[] (void *p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete (void *p, const std::nothrow_t &) noexcept {
+  free(p);
+}
+
+void operator delete[] (void *p, const std::nothrow_t &) noexcept {
+  free(p);
+}
+
+#ifdef __cpp_aligned_new
+// over-aligned types (C++17 and up)
+static void *beatstepAllocateAligned (size_t size, std::align_val_t alignment) {
+  beatstepAllocations.fetch_add(1, std::memory_order_relaxed);
+  size_t a = (size_t)alignment;
+#if defined(_WIN32)
+  return _aligned_malloc(size ? size : 1, a);
+#else
+  // aligned_alloc wants a multiple of the alignment
+  return aligned_alloc(a, ((size ? size : 1) + a - 1) / a * a);
+#endif
+}
+
+static void beatstepFreeAligned (void *p) {
+#if defined(_WIN32)
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
+
+void *operator new (size_t size, std::align_val_t alignment) {
+  void *p = beatstepAllocateAligned(size, alignment);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[] (size_t size, std::align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+void *operator new (size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+  return beatstepAllocateAligned(size, alignment);
+}
+
+void *operator new[] (size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept {
+  return beatstepAllocateAligned(size, alignment);
+}
+
+void operator delete (void *p, std::align_val_t) noexcept {
+  beatstepFreeAligned(p);
+}
+
+void operator delete[] (void *p, std::align_val_t) noexcept {
+  beatstepFreeAligned(p);
+}
+
+void operator delete (void *p, size_t, std::align_val_t) noexcept {
+  beatstepFreeAligned(p);
+}
+
+void operator delete[] (void *p, size_t, std::align_val_t) noexcept {
+  beatstepFreeAligned(p);
+}
+
+void operator delete (void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+  beatstepFreeAligned(p);
+}
+
+void operator delete[] (void *p, std::align_val_t, const std::nothrow_t &) noexcept {
+  beatstepFreeAligned(p);
+}
+#endif
@@ -1,18 +1,41 @@
-#include "RtMidi.h"
+#include "BeatstepTransport.hpp"
 #include <vector>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <future>
+#include <functional>
+#include <memory>
+#include <deque>
 #include <fstream>
 #include <iterator>
+#include <algorithm>
+#include <random>
+#include <ctime>
 #include <json.hpp>
+#include "BeatstepPacer.hpp"
+#include "BeatstepSysex.hpp"
+#include "BeatstepParams.hpp"
+#include "BeatstepPreset.hpp"
+#include "BeatstepMask.hpp"
+#include "BeatstepRing.hpp"
+#include "BeatstepRealtime.hpp"
+#include "BeatstepCapture.hpp"
 
 using json = nlohmann::ordered_json;
 
 // Platform-dependent sleep routines.
 #if defined(WIN32)
   #include <windows.h>
+  #include <direct.h>
   #define SLEEP( milliseconds ) Sleep( (DWORD) milliseconds ) 
+  #define MKDIR( path ) _mkdir( path )
 #else // Unix variants
   #include <unistd.h>
+  #include <sys/stat.h>
   #define SLEEP( milliseconds ) usleep( (unsigned long) (milliseconds * 1000.0) )
+  #define MKDIR( path ) mkdir( path, 0755 )
 #endif
 
 enum BeatstepControls {
@@ -92,26 +115,147 @@ enum BeatstepControllerBehavior {
   BEATSTEP_CONTROLLER_BEHAVIORS_GATE
 };
 
+// the result of reading one address in a bulk get
+struct BeatstepReading {
+  BeatstepAddress address;
+  unsigned char value;
+  bool ok; // false if the device never answered
+};
+
+// a value to set on the device
+struct BeatstepSetting {
+  unsigned char cc;
+  unsigned char pp;
+  unsigned char value;
+};
+
+// someone waiting on a reply from the device (these form a list, so waiting never allocates)
+struct BeatstepWaiter {
+  unsigned int key;
+  bool done;
+  unsigned char reply[BEATSTEP_REPLY_MAX];
+  BeatstepWaiter *next;
+};
+
+// kinds of operation the I/O thread can run
+enum BeatstepJobType {
+  BEATSTEP_JOB_GET,
+  BEATSTEP_JOB_SET,
+  BEATSTEP_JOB_VERSION
+};
+
+// an operation queued for the I/O thread
+struct BeatstepJob {
+  BeatstepJobType type;
+  BeatstepSetting setting;
+  std::function<void(bool ok, unsigned char value)> onValue;
+  std::function<void(std::vector<unsigned char> version)> onVersion;
+  std::function<void(std::exception_ptr error)> onError;  // if the job threw (otherwise that's reported as not ok)
+};
+
+// how a load went (diff-mode leaves out values the device already has), or a save
+struct BeatstepLoadStats {
+  unsigned int written;
+  unsigned int skipped;  // values the shadow already had (so they weren't written, or for a save, read)
+  unsigned int read;
+  unsigned int retried;  // with verify: written more than once before they stuck (or we gave up)
+  unsigned int failed;   // with verify: never read back right
+  unsigned int sampled;  // with a verify sample: how many were read back first
+  bool escalated;        // with a verify sample: whether a mismatch meant reading back everything
+  unsigned int bound;    // with a verify sample that all matched: at most this many writes are wrong (at 95% confidence)
+};
+
+// what reading back one written value found
+struct BeatstepVerifyResult {
+  BeatstepSetting setting;
+  bool checked;        // false if it wasn't in the sample (so ok just means "assumed fine")
+  bool ok;             // read back as written
+  bool answered;       // false if the last read-back got no reply
+  unsigned char got;   // what the last read-back said
+  unsigned int tries;  // how many times it was written
+};
+
+// read-back passes a verified write gets, and the wait before the first retry (doubled each time)
+#define BEATSTEP_VERIFY_TRIES 4
+#define BEATSTEP_VERIFY_BACKOFF_MS 10
+
+// how sure a sampled verify's bound is
+#define BEATSTEP_VERIFY_CONFIDENCE 0.95
+
+// if a sample of `sampled` (out of `total`) all read back right, the most that can be wrong at this confidence:
+// the biggest count of bad writes that still has at least a (1 - confidence) chance of every sample missing them
+inline unsigned int beatstepSampleBound (unsigned int total, unsigned int sampled, double confidence = BEATSTEP_VERIFY_CONFIDENCE) {
+  unsigned int bad = 0;
+  while (bad < total - sampled) {
+    // chance that none of the samples land on bad + 1 wrong writes (hypergeometric)
+    double missed = 1;
+    for (unsigned int i = 0; i < sampled; i++) {
+      missed *= (double)(total - (bad + 1) - i) / (total - i);
+    }
+    if (missed < 1 - confidence) {
+      break;
+    }
+    bad++;
+  }
+  return bad;
+}
+
+// key that identity-replies are filed under (param-replies use (pp << 8) | cc)
+#define BEATSTEP_KEY_IDENTITY 0x10000
+
+// the shadow has a slot for every (pp << 8) | cc, holding the last value we know the device has
+#define BEATSTEP_SHADOW_SIZE 0x8000
+#define BEATSTEP_SHADOW_UNKNOWN -1
+
+// how many cached values are read back to check a device hasn't changed since its shadow was saved
+#define BEATSTEP_SHADOW_SENTINELS 8
+
+// how long (in seconds) a shadow that passed that check is trusted without checking again
+// (so a script doing one get after another reads from the cache, instead of the device)
+#define BEATSTEP_SHADOW_TRUST 60
+
+// sysex data bytes are 7-bit, so anything above 0x7F can't be sent (or shadowed)
+inline void beatstepCheckAddress (unsigned char cc, unsigned char pp) {
+  if (cc > 0x7F || pp > 0x7F) {
+    throw std::invalid_argument("Out of range: " + std::to_string(cc) + ":" + std::to_string(pp));
+  }
+}
+
+inline void beatstepCheckSetting (unsigned char cc, unsigned char pp, unsigned char vv) {
+  beatstepCheckAddress(cc, pp);
+  if (vv > 0x7F) {
+    throw std::invalid_argument("Out of range: " + std::to_string(cc) + ":" + std::to_string(pp) + " = " + std::to_string(vv));
+  }
+}
+
 class BeatStep {
   public:
-    BeatStep () {
-      try {
-        this->midiout = new RtMidiOut();
-        this->midiin = new RtMidiIn();
-      } catch ( RtMidiError &error ) {
-        error.printMessage();
-        exit( EXIT_FAILURE );
-      }
+    // transport is owned by the BeatStep from here on (RtMidi is used if there isn't one)
+    BeatStep (BeatstepTransport *transport = nullptr) {
+      this->transport = transport ? transport : new BeatstepRtMidiTransport();
+      this->forgetShadow();
     }
-    
+
     ~BeatStep () {
-      delete this->midiout;
-      delete this->midiin;
+      if (this->ioThread.joinable()) {
+        {
+          std::lock_guard<std::mutex> lock(this->jobLock);
+          this->stopping = true;
+        }
+        this->jobReady.notify_one();
+        this->ioThread.join();
+      }
+      delete this->transport;
+      if (this->dispatchThread.joinable()) {
+        this->closing.store(true);
+        this->wake.post();
+        this->dispatchThread.join();
+      }
     }
 
     // get a list of MIDI devices
     void list () {
-      unsigned int nPorts = this->midiout->getPortCount();
+      unsigned int nPorts = this->transport->portCount();
       std::string portName;
       
       if (nPorts == 1) {
@@ -122,10 +266,10 @@ class BeatStep {
 
       for ( unsigned int i=0; i<nPorts; i++ ) {
         try {
-          portName = this->midiout->getPortName(i);
+          portName = this->transport->portName(i);
         }
-        catch (RtMidiError &error) {
-          error.printMessage();
+        catch (std::exception &error) {
+          std::cerr << error.what() << std::endl;
           return;
         }
         std::cout << '\t' << i+1 << ": " << portName << '\n';
@@ -134,462 +278,1202 @@ class BeatStep {
       std::cout << '\n';
     }
 
-    void openPort(int device) {
-      this->midiout->openPort(device);
-      this->midiin->openPort(device);
-      this->midiin->ignoreTypes(false, false, false);
+    // the first port with name in its name, or -1
+    int findPort (std::string name) {
+      unsigned int nPorts = this->transport->portCount();
+      for (unsigned int i = 0; i < nPorts; i++) {
+        if (this->transport->portName(i).find(name) != std::string::npos) {
+          return i;
+        }
+      }
+      return -1;
     }
 
-    // set a beatstep param
-    void set (unsigned char cc, unsigned char pp, unsigned char vv) {
-      std::vector<unsigned char> message = {0xF0, 0x00, 0x20, 0x6B, 0x7F, 0x42, 0x02, 0x00, pp, cc, vv, 0xF7};
-      this->midiout->sendMessage(&message);
-      SLEEP(1);
+    void openPort(int device) {
+      this->portName = this->transport->portName(device);
+      this->transport->setReceiver(&BeatStep::receive, this);
+      this->transport->openPort(device);
+      if (!this->dispatchThread.joinable()) {
+        this->dispatchThread = std::thread(&BeatStep::dispatch, this);
+      }
     }
 
-    // set the color of a pad's LED
-    void color (unsigned char pad, BeatstepColor color) {
-      this->set(pad, 0x10, color);
+    // figure out which waiter a message from the device is for, or -1 if it's not a reply
+    static int replyKey (const unsigned char *message, size_t nBytes) {
+      if (beatstepMatches(BEATSTEP_PARAM_REPLY, message, nBytes)) {
+        return (message[8] << 8) | message[9];
+      }
+      if (beatstepMatches(BEATSTEP_IDENTITY_REPLY, message, nBytes)) {
+        return BEATSTEP_KEY_IDENTITY;
+      }
+      return -1;
     }
 
-    // update firmware
-    bool updateFirmware (std::string filename){
-      std::ifstream input(filename, std::ios::binary);
-      std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(input), {});
+    // called by the transport for every incoming message: channel-messages go in the events ring,
+    // and sysex is split into whole messages for the replies ring (this never allocates, and only locks
+    // when recording: see setCapture)
+    static void receive (double deltatime, const unsigned char *data, size_t size, void *userData) {
+      BeatStep *self = (BeatStep *)userData;
 
-      // TODO: no iddea how to turn led into sysex, can't seem to capture it either
+      if (self->realtime.enabled && !self->receiverPromoted.exchange(true)) {
+        self->promote("receiver");
+      }
 
-      return true;
+      if (self->capture) {
+        self->capture->record(BEATSTEP_CAPTURE_IN, data, size);
+      }
+
+      if (size && size <= 3 && data[0] >= 0x80 && data[0] < 0xF0) {
+        BeatstepEvent *event = self->events.claim();
+        if (event) {
+          event->size = size;
+          std::copy(data, data + size, event->bytes);
+          event->deltatime = deltatime;
+          self->events.publish();
+        }
+        return;
+      }
+
+      bool got = false;
+      self->parser.feed(data, size, [self, &got](const unsigned char *frame, size_t size) {
+        BeatstepSysexSlot *slot = self->replies.claim();
+        if (slot) {
+          slot->stamp = std::chrono::steady_clock::now();
+          slot->size = size;
+          std::copy(frame, frame + size, slot->bytes);
+          self->replies.publish();
+          got = true;
+        }
+      });
+
+      // only the first reply after the dispatcher parks wakes it (and that's a semaphore post, not a lock)
+      if (got) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (self->parked.load() && self->parked.exchange(false)) {
+          self->wake.post();
+        }
+      }
     }
 
-    // get the firmware version on the device
-    std::vector<unsigned char> version() {
-      std::vector<unsigned char> message = { 0xF0, 0x7E, 0x7F, 0x06, 0x01, 0xF7 };
-      this->midiout->sendMessage(&message);
+    // the dispatcher thread: takes sysex out of the replies ring, and hands it to waiters
+    void dispatch () {
+      this->promote("dispatcher");
+      while (true) {
+        BeatstepSysexSlot *slot;
+        while ((slot = this->replies.front())) {
+          this->dispatchLatency.record(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - slot->stamp).count());
+          this->deliver(slot->bytes, slot->size);
+          this->replies.release();
+        }
 
-      SLEEP(1);
-      message.clear();
-      std::vector<unsigned char> version = {0,0,0,0};
-      
-      this->midiin->getMessage(&message);
-      size_t nBytes = message.size();
-
-      if (
-        nBytes == 17 &&
-        message[0] == 0xF0 &&
-        message[1] == 0x7E &&
-        message[2] == 0x00 &&
-        message[3] == 0x06 &&
-        message[4] == 0x02 &&
-        message[5] == 0x00 &&
-        message[6] == 0x20 &&
-        message[7] == 0x6B &&
-        message[8] == 0x02 &&
-        message[9] == 0x00 &&
-        message[10] == 0x06 &&
-        message[11] == 0x00 &&
-        message[16] == 0xF7
-      ) {
-        version[0] = message[15];
-        version[1] = message[14];
-        version[2] = message[13];
-        version[3] = message[12];
+        // park, unless something came in (or we're closing) between draining and saying so
+        // (a post that lands after we've looked again just makes the next wait return straight away)
+        this->parked.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (this->replies.empty() && !this->closing.load()) {
+          this->wake.wait();
+        }
+        this->parked.store(false);
+        if (this->closing.load()) {
+          return;
+        }
       }
+    }
 
-      return version;
+    // record everything sent to & received from the device (call before openPort)
+    // each message is copied into the capture's buffer under its lock, which is shared with sends (from
+    // other threads) and the writer swapping buffers, but never held over the disk, so it's short
+    void setCapture (BeatstepCaptureWriter *capture) {
+      this->capture = capture;
     }
 
-    // get a setting
-    unsigned char get (unsigned char cc, unsigned char pp) {
-      std::vector<unsigned char> message = { 0xF0, 0x00, 0x20, 0x6B, 0x7F, 0x42, 0x01, 0x00, pp, cc, 0xF7 };
-      this->midiout->sendMessage(&message);
-      size_t nBytes;
-      int tryCount = 0;
-      while (true) {
-        tryCount++;
-        SLEEP(1);
-        message.clear();
-        this->midiin->getMessage(&message);
-        nBytes = message.size();
-        if (
-          nBytes == 12 &&
-          message[0] == 0xF0 &&
-          message[1] == 0x00 &&
-          message[2] == 0x20 &&
-          message[3] == 0x6B &&
-          message[4] == 0x7F &&
-          message[5] == 0x42 &&
-          message[6] == 0x02 &&
-          message[7] == 0x00 &&
-          message[8] == pp &&
-          message[9] == cc &&
-          message[11] == 0xF7
-        ) {
-          // std::cout << (int)cc << '_' << (int)pp << '=' << (int)message[10] << std::endl;
-          return message[10];
-        }
-        if (tryCount > 10) {
-          throw std::invalid_argument("No response: " + std::to_string(cc) + ":" + std::to_string(pp));
-        }
-      }
-    }
-
-    // save preset
-    bool savePreset (std::string filename) {
-      unsigned char cc = 0x20;
-      unsigned char pp = 0x01;
-
-      json j = {
-        { "device", "BeatStep" }
-      };
-      
-      for (cc = 0x20; cc < 0x31; cc++) {
-        for (pp = 0x01; pp < 0x07; pp++) {
-          j[std::to_string(cc) + "_" + std::to_string(pp)] = this->get(cc, pp);
-        }
-      }
-
-      for (cc = 0x58; cc < 0x60; cc++) {
-        for (pp = 0x01; pp < 0x07; pp++) {
-          j[std::to_string(cc) + "_" + std::to_string(pp)] = this->get(cc, pp);
-        }
-      }
-
-      for (cc = 0x70; cc < 0x80; cc++) {
-        for (pp = 0x01; pp < 0x07; pp++) {
-          j[std::to_string(cc) + "_" + std::to_string(pp)] = this->get(cc, pp);
-        }
-      }
-
-      // TODO: this would be nicer in a loop
-      j["global_" + std::to_string(0x00) + "_" + std::to_string(0x52)] = this->get(0x00, 0x52);
-      j["global_" + std::to_string(0x00) + "_" + std::to_string(0x53)] = this->get(0x00, 0x53);
-      j["global_" + std::to_string(0x01) + "_" + std::to_string(0x50)] = this->get(0x01, 0x50);
-      j["global_" + std::to_string(0x01) + "_" + std::to_string(0x52)] = this->get(0x01, 0x52);
-      j["global_" + std::to_string(0x01) + "_" + std::to_string(0x53)] = this->get(0x01, 0x53);
-      j["global_" + std::to_string(0x02) + "_" + std::to_string(0x50)] = this->get(0x02, 0x50);
-      j["global_" + std::to_string(0x02) + "_" + std::to_string(0x52)] = this->get(0x02, 0x52);
-      j["global_" + std::to_string(0x02) + "_" + std::to_string(0x53)] = this->get(0x02, 0x53);
-      j["global_" + std::to_string(0x03) + "_" + std::to_string(0x41)] = this->get(0x03, 0x41);
-      j["global_" + std::to_string(0x03) + "_" + std::to_string(0x50)] = this->get(0x03, 0x50);
-      j["global_" + std::to_string(0x03) + "_" + std::to_string(0x52)] = this->get(0x03, 0x52);
-      j["global_" + std::to_string(0x03) + "_" + std::to_string(0x53)] = this->get(0x03, 0x53);
-      j["global_" + std::to_string(0x04) + "_" + std::to_string(0x41)] = this->get(0x04, 0x41);
-      j["global_" + std::to_string(0x04) + "_" + std::to_string(0x50)] = this->get(0x04, 0x50);
-      j["global_" + std::to_string(0x04) + "_" + std::to_string(0x52)] = this->get(0x04, 0x52);
-      j["global_" + std::to_string(0x04) + "_" + std::to_string(0x53)] = this->get(0x04, 0x53);
-      j["global_" + std::to_string(0x05) + "_" + std::to_string(0x50)] = this->get(0x05, 0x50);
-      j["global_" + std::to_string(0x05) + "_" + std::to_string(0x52)] = this->get(0x05, 0x52);
-      j["global_" + std::to_string(0x05) + "_" + std::to_string(0x53)] = this->get(0x05, 0x53);
-      j["global_" + std::to_string(0x06) + "_" + std::to_string(0x40)] = this->get(0x06, 0x40);
-      j["global_" + std::to_string(0x06) + "_" + std::to_string(0x50)] = this->get(0x06, 0x50);
-      j["global_" + std::to_string(0x06) + "_" + std::to_string(0x52)] = this->get(0x06, 0x52);
-      j["global_" + std::to_string(0x06) + "_" + std::to_string(0x53)] = this->get(0x06, 0x53);
-      j["global_" + std::to_string(0x07) + "_" + std::to_string(0x50)] = this->get(0x07, 0x50);
-      j["global_" + std::to_string(0x07) + "_" + std::to_string(0x52)] = this->get(0x07, 0x52);
-      j["global_" + std::to_string(0x07) + "_" + std::to_string(0x53)] = this->get(0x07, 0x53);
-      j["global_" + std::to_string(0x08) + "_" + std::to_string(0x50)] = this->get(0x08, 0x50);
-      j["global_" + std::to_string(0x08) + "_" + std::to_string(0x52)] = this->get(0x08, 0x52);
-      j["global_" + std::to_string(0x08) + "_" + std::to_string(0x53)] = this->get(0x08, 0x53);
-      j["global_" + std::to_string(0x09) + "_" + std::to_string(0x50)] = this->get(0x09, 0x50);
-      j["global_" + std::to_string(0x09) + "_" + std::to_string(0x52)] = this->get(0x09, 0x52);
-      j["global_" + std::to_string(0x09) + "_" + std::to_string(0x53)] = this->get(0x09, 0x53);
-      j["global_" + std::to_string(0x0A) + "_" + std::to_string(0x50)] = this->get(0x0A, 0x50);
-      j["global_" + std::to_string(0x0A) + "_" + std::to_string(0x52)] = this->get(0x0A, 0x52);
-      j["global_" + std::to_string(0x0A) + "_" + std::to_string(0x53)] = this->get(0x0A, 0x53);
-      j["global_" + std::to_string(0x0B) + "_" + std::to_string(0x50)] = this->get(0x0B, 0x50);
-      j["global_" + std::to_string(0x0B) + "_" + std::to_string(0x52)] = this->get(0x0B, 0x52);
-      j["global_" + std::to_string(0x0B) + "_" + std::to_string(0x53)] = this->get(0x0B, 0x53);
-      j["global_" + std::to_string(0x0C) + "_" + std::to_string(0x50)] = this->get(0x0C, 0x50);
-      j["global_" + std::to_string(0x0C) + "_" + std::to_string(0x52)] = this->get(0x0C, 0x52);
-      j["global_" + std::to_string(0x0C) + "_" + std::to_string(0x53)] = this->get(0x0C, 0x53);
-      j["global_" + std::to_string(0x0D) + "_" + std::to_string(0x52)] = this->get(0x0D, 0x52);
-      j["global_" + std::to_string(0x0D) + "_" + std::to_string(0x53)] = this->get(0x0D, 0x53);
-      j["global_" + std::to_string(0x0E) + "_" + std::to_string(0x52)] = this->get(0x0E, 0x52);
-      j["global_" + std::to_string(0x0E) + "_" + std::to_string(0x53)] = this->get(0x0E, 0x53);
-      j["global_" + std::to_string(0x0F) + "_" + std::to_string(0x52)] = this->get(0x0F, 0x52);
-      j["global_" + std::to_string(0x0F) + "_" + std::to_string(0x53)] = this->get(0x0F, 0x53);
-
-      std::ofstream o(filename);
-      o << std::setw(2) << j << std::endl;
+    // run our MIDI threads (receiver, dispatcher, I/O) with realtime priority (call before openPort)
+    void setRealtime (const BeatstepRealtimeOptions &options) {
+      this->realtime = options;
+      if (options.enabled && options.lockMemory) {
+        std::string error = beatstepLockMemory();
+        if (!error.empty()) {
+          std::lock_guard<std::mutex> lock(this->realtimeLock);
+          this->realtimeProblems.push_back(error);
+        }
+      }
+    }
 
-      return true;
+    // make the calling thread realtime, if that was asked for (and note it if we can't)
+    void promote (std::string name) {
+      if (!this->realtime.enabled) {
+        return;
+      }
+      std::string error = beatstepPromoteThread(this->realtime);
+      std::lock_guard<std::mutex> lock(this->realtimeLock);
+      if (error.empty()) {
+        this->realtimeThreads++;
+      } else {
+        this->realtimeProblems.push_back(name + ": " + error);
+      }
     }
 
-    // load preset
-    bool loadPreset (std::string filename){
-      std::ifstream i(filename);
-      json j;
-      i >> j;
+    // how realtime-mode went
+    std::string realtimeStatus () {
+      std::lock_guard<std::mutex> lock(this->realtimeLock);
+      if (!this->realtime.enabled) {
+        return "off";
+      }
+      std::string status = std::to_string(this->realtimeThreads) + " realtime threads";
+      if (!this->realtimeProblems.empty()) {
+        status += ", fell back to normal scheduling for:";
+        for (const std::string &problem : this->realtimeProblems) {
+          status += "\n  " + problem;
+        }
+      }
+      return status;
+    }
+
+    // take the next channel-message (note, cc, etc) the device sent, if there is one
+    // (only call this from one thread; if nobody calls it, the ring fills and overflows are counted)
+    bool nextEvent (BeatstepEvent &event) {
+      BeatstepEvent *front = this->events.front();
+      if (!front) {
+        return false;
+      }
+      event = *front;
+      this->events.release();
+      return true;
+    }
 
-      std::string k;
-      unsigned char cc = 0x20;
-      unsigned char pp = 0x01;
+    // wake whoever is waiting on this reply
+    void deliver (const unsigned char *message, size_t nBytes) {
+      int key = replyKey(message, nBytes);
+      if (key < 0) {
+        return;
+      }
+      std::lock_guard<std::mutex> lock(this->replyLock);
 
-      for (cc = 0x20; cc < 0x31; cc++) {
-        for (pp = 0x01; pp < 0x07; pp++) {
-          k = std::to_string(cc) + "_" + std::to_string(pp);
-          if (j.contains(k)) {
-            this->set(cc, pp, j[k]);
-          }
+      // oldest waiter for this key gets it (new waiters go on the front of the list)
+      BeatstepWaiter **found = nullptr;
+      for (BeatstepWaiter **w = &this->waiters; *w; w = &(*w)->next) {
+        if ((*w)->key == (unsigned int)key) {
+          found = w;
         }
       }
+      if (found) {
+        BeatstepWaiter *waiter = *found;
+        std::copy(message, message + nBytes, waiter->reply);
+        waiter->done = true;
+        *found = waiter->next;
+        this->replyReady.notify_all();
+      }
+    }
 
-      for (cc = 0x58; cc < 0x60; cc++) {
-        for (pp = 0x01; pp < 0x07; pp++) {
-          k = std::to_string(cc) + "_" + std::to_string(pp);
-          if (j.contains(k)) {
-            this->set(cc, pp, j[k]);
-          }
+    // start waiting for a reply (do this before sending the request, so a fast reply isn't missed)
+    void expect (unsigned int key, BeatstepWaiter *waiter) {
+      std::lock_guard<std::mutex> lock(this->replyLock);
+      waiter->key = key;
+      waiter->done = false;
+      waiter->next = this->waiters;
+      this->waiters = waiter;
+    }
+
+    // stop waiting on a reply that never came
+    void forget (BeatstepWaiter *waiter) {
+      std::lock_guard<std::mutex> lock(this->replyLock);
+      for (BeatstepWaiter **w = &this->waiters; *w; w = &(*w)->next) {
+        if (*w == waiter) {
+          *w = waiter->next;
+          return;
         }
       }
+    }
 
-      for (cc = 0x70; cc < 0x80; cc++) {
-        for (pp = 0x01; pp < 0x07; pp++) {
-          k = std::to_string(cc) + "_" + std::to_string(pp);
-          if (j.contains(k)) {
-            this->set(cc, pp, j[k]);
-          }
+    // stop waiting on any of count waiters that are still listed, in one pass (for leaving early)
+    void forget (BeatstepWaiter *first, size_t count) {
+      std::lock_guard<std::mutex> lock(this->replyLock);
+      for (BeatstepWaiter **w = &this->waiters; *w;) {
+        if (!std::less<BeatstepWaiter *>()(*w, first) && std::less<BeatstepWaiter *>()(*w, first + count)) {
+          *w = (*w)->next;
+        } else {
+          w = &(*w)->next;
         }
       }
+    }
 
-      // TODO: this would be nicer in a loop
-      k = "global_" + std::to_string(0x00) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x00, 0x52, j[k]);
+    // forgets waiters if whoever's waiting on them leaves by an exception (say, the transport's send threw),
+    // so a late reply isn't written into them once they're gone (dismiss it once they're all settled)
+    struct WaiterGuard {
+      BeatStep *self;
+      BeatstepWaiter *first;
+      size_t count;
+
+      ~WaiterGuard () {
+        if (this->first) {
+          this->self->forget(this->first, this->count);
+        }
       }
 
-      k = "global_" + std::to_string(0x00) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x00, 0x53, j[k]);
+      void dismiss () {
+        this->first = nullptr;
       }
+    };
+
+    // block until a waiter has its reply, or the deadline passes
+    bool await (BeatstepWaiter *waiter, std::chrono::steady_clock::time_point deadline) {
+      std::unique_lock<std::mutex> lock(this->replyLock);
+      return this->replyReady.wait_until(lock, deadline, [waiter]{ return waiter->done; });
+    }
 
-      k = "global_" + std::to_string(0x01) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x01, 0x50, j[k]);
+    // send raw bytes to the device (safe to call from more than one thread)
+    void send (const unsigned char *message, size_t size) {
+      std::lock_guard<std::mutex> lock(this->sendLock);
+      if (this->capture) {
+        this->capture->record(BEATSTEP_CAPTURE_OUT, message, size);
       }
+      this->transport->send(message, size);
+    }
+
+    // set a beatstep param
+    void set (unsigned char cc, unsigned char pp, unsigned char vv) {
+      BeatstepSetting setting = { cc, pp, vv };
+      this->setMany(&setting, 1);
+    }
 
-      k = "global_" + std::to_string(0x01) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x01, 0x52, j[k]);
+    // set many beatstep params: their frames are packed into one buffer, and sent in
+    // as few writes as the pacer allows
+    void setMany (const BeatstepSetting *settings, size_t count) {
+      for (size_t i = 0; i < count; i++) {
+        beatstepCheckSetting(settings[i].cc, settings[i].pp, settings[i].value);
       }
+      std::lock_guard<std::mutex> lock(this->sendLock);
 
-      k = "global_" + std::to_string(0x01) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x01, 0x53, j[k]);
+      // the buffer only ever grows, so once it's big enough this doesn't allocate
+      size_t frameSize = BeatstepFrame<12>::size();
+      if (this->sendBuffer.size() < count * frameSize) {
+        this->sendBuffer.resize(count * frameSize);
+      }
+      for (size_t i = 0; i < count; i++) {
+        BeatstepFrame<12> frame = beatstepSetFrame(settings[i].cc, settings[i].pp, settings[i].value);
+        std::copy(frame.bytes, frame.bytes + frameSize, &this->sendBuffer[i * frameSize]);
       }
 
-      k = "global_" + std::to_string(0x02) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x02, 0x50, j[k]);
+      size_t sent = 0;
+      while (sent < count) {
+        size_t n = this->pacer.take(count - sent);
+        if (this->capture) {
+          this->capture->record(BEATSTEP_CAPTURE_OUT, &this->sendBuffer[sent * frameSize], n * frameSize);
+        }
+        this->transport->send(&this->sendBuffer[sent * frameSize], n * frameSize);
+        sent += n;
       }
 
-      k = "global_" + std::to_string(0x02) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x02, 0x52, j[k]);
+      std::lock_guard<std::mutex> shadowGuard(this->shadowLock);
+      for (size_t i = 0; i < count; i++) {
+        this->shadow[shadowSlot(settings[i].cc, settings[i].pp)] = settings[i].value;
       }
+    }
 
-      k = "global_" + std::to_string(0x02) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x02, 0x53, j[k]);
+    void setMany (const std::vector<BeatstepSetting> &settings) {
+      this->setMany(settings.data(), settings.size());
+    }
+
+    // find out how fast the device can take writes: write the pad-notes at faster and faster
+    // rates, reading them back each time, and keep the fastest rate that didn't lose anything
+    // (throws, naming them, if the pad-notes can't be put back how they were afterwards)
+    // each step writes a whole preset's worth (the pad-notes over & over), so it's more than a burst
+    // and the rate is really kept up, with the same burst a load gets
+    double probePace (double ceiling = 16000) {
+      std::vector<BeatstepAddress> addresses;
+      for (unsigned char cc = 0x70; cc < 0x80; cc++) {
+        addresses.push_back({ cc, 0x03 });
       }
 
-      k = "global_" + std::to_string(0x03) + "_" + std::to_string(0x41);
-      if (j.contains(k)) {
-        this->set(0x03, 0x41, j[k]);
+      std::vector<BeatstepReading> original = this->getMany(addresses);
+      for (const BeatstepReading &r : original) {
+        if (!r.ok) {
+          throw std::invalid_argument("No response: " + std::to_string(r.address.cc) + ":" + std::to_string(r.address.pp));
+        }
       }
 
-      k = "global_" + std::to_string(0x03) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x03, 0x50, j[k]);
+      double safe = 0;
+      unsigned int offset = 1;
+      size_t rounds = (BEATSTEP_PARAM_COUNT + addresses.size() - 1) / addresses.size();
+      for (double rate = 250; rate <= ceiling; rate *= 2) {
+        this->pacer.setRate(rate, rate / BEATSTEP_PACER_BURST_RATIO);
+        std::vector<BeatstepSetting> settings;
+        for (size_t round = 0; round < rounds; round++) {
+          for (const BeatstepReading &r : original) {
+            settings.push_back({ r.address.cc, r.address.pp, (unsigned char)((r.value + offset + round) & 0x7F) });
+          }
+        }
+        this->setMany(settings);
+
+        // the last round is what should be there now
+        std::vector<BeatstepReading> readback = this->getMany(addresses);
+        bool clean = true;
+        for (size_t i = 0; i < readback.size(); i++) {
+          clean = clean && readback[i].ok && readback[i].value == ((original[i].value + offset + rounds - 1) & 0x7F);
+        }
+        if (!clean) {
+          break;
+        }
+        safe = rate;
+        offset += rounds;
       }
 
-      k = "global_" + std::to_string(0x03) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x03, 0x52, j[k]);
+      // put the pads back how they were, slowing down until that sticks
+      this->pacer.setRate(safe ? safe : 125, safe / BEATSTEP_PACER_BURST_RATIO);
+      std::vector<BeatstepSetting> settings;
+      for (const BeatstepReading &r : original) {
+        settings.push_back({ r.address.cc, r.address.pp, r.value });
+      }
+      std::string wrong;
+      for (int attempt = 0; attempt < 4; attempt++) {
+        this->setMany(settings);
+        std::vector<BeatstepReading> readback = this->getMany(addresses);
+        wrong.clear();
+        for (size_t i = 0; i < readback.size(); i++) {
+          if (!readback[i].ok || readback[i].value != original[i].value) {
+            wrong += (wrong.empty() ? "" : ", ") + std::to_string(addresses[i].cc) + ":" + std::to_string(addresses[i].pp) + " (should be " + std::to_string(original[i].value)
+              + (readback[i].ok ? ", is " + std::to_string(readback[i].value) : ", no response") + ")";
+          }
+        }
+        if (wrong.empty()) {
+          break;
+        }
+        this->pacer.backoff();
+      }
+      if (!wrong.empty()) {
+        throw std::invalid_argument("Could not put the pad-notes back: " + wrong);
       }
 
-      k = "global_" + std::to_string(0x03) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x03, 0x53, j[k]);
+      return this->pacer.rate;
+    }
+
+    // something that identifies this device: the port-name and firmware version
+    // (asked once a run; "" if the device didn't answer, since version() gives 0.0.0.0 then, and that's no key)
+    std::string deviceId () {
+      if (this->identity.empty() && !this->identityAsked) {
+        this->identityAsked = true;
+        std::vector<unsigned char> v = this->version();
+        if (v != std::vector<unsigned char>(4, 0)) {
+          this->identity = this->portName + " " + std::to_string(v[0]) + "." + std::to_string(v[1]) + "." + std::to_string(v[2]) + "." + std::to_string(v[3]);
+        }
       }
+      return this->identity;
+    }
 
-      k = "global_" + std::to_string(0x04) + "_" + std::to_string(0x41);
-      if (j.contains(k)) {
-        this->set(0x04, 0x41, j[k]);
+    // use the write-rate that was learned for this device, if there is one
+    bool loadPace () {
+      std::ifstream i(cachePath("pace.json"));
+      if (!i) {
+        return false;
       }
+      json j = json::parse(i, nullptr, false);
+      std::string id = this->deviceId();
+      if (id.empty() || j.is_discarded() || !j.is_object() || !j.contains(id) || !j[id].is_number()) {
+        return false;
+      }
+      double rate = j[id].get<double>();
+      if (!(rate > 0)) {
+        return false;
+      }
+      this->pacer.setRate(rate, rate / BEATSTEP_PACER_BURST_RATIO);
+      return true;
+    }
 
-      k = "global_" + std::to_string(0x04) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x04, 0x50, j[k]);
+    // remember the current write-rate for this device (unless it won't say what it is)
+    void savePace () {
+      std::string id = this->deviceId();
+      if (id.empty()) {
+        return;
       }
+      std::string filename = cachePath("pace.json");
+      json j;
+      {
+        std::ifstream i(filename);
+        if (i) {
+          j = json::parse(i, nullptr, false);
+        }
+      }
+      if (!j.is_object()) {
+        j = json::object();
+      }
+      j[id] = this->pacer.rate;
 
-      k = "global_" + std::to_string(0x04) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x04, 0x52, j[k]);
+      std::string temporary = filename + ".tmp";
+      {
+        std::ofstream o(temporary);
+        o << std::setw(2) << j << std::endl;
       }
+      beatstepReplaceFile(temporary, filename);
+    }
 
-      k = "global_" + std::to_string(0x04) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x04, 0x53, j[k]);
+    // pick up the shadow saved for this device, if a few of its values (picked at random) still read back the same
+    // (what's already known from this run wins over what was cached)
+    // with check off, nothing is asked of the device: the shadow is only used if a device on this port passed
+    // that check in the last BEATSTEP_SHADOW_TRUST seconds, and is taken to still be the same one
+    bool loadShadow (bool check = true) {
+      // checking also finds out who the device is, so saveShadow can start a cache for it if there's none
+      std::string id = check ? this->deviceId() : "";
+      std::ifstream i(cachePath("shadow.json"));
+      if (!i) {
+        return false;
+      }
+      json j = json::parse(i, nullptr, false);
+      if (j.is_discarded() || !j.is_object()) {
+        return false;
+      }
+      if (!check) {
+        id = this->portShadow(j, true);
+      }
+      if (id.empty() || !j.contains(id)) {
+        return false;
+      }
+      std::vector<BeatstepSetting> cached;
+      long long checked;
+      if (!readShadow(j[id], cached, checked)) {
+        // and don't let saveShadow keep any of it either
+        this->shadowStale = true;
+        return false;
+      }
+      if (cached.empty()) {
+        return false;
+      }
+      if (!check) {
+        this->identity = id;
+        this->shadowChecked = checked;
+        this->rememberShadow(cached);
+        return true;
       }
 
-      k = "global_" + std::to_string(0x05) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x05, 0x50, j[k]);
+      std::mt19937 random(std::random_device{}());
+      std::vector<size_t> sentinels;
+      std::vector<BeatstepAddress> addresses;
+      for (unsigned int k = 0; k < BEATSTEP_SHADOW_SENTINELS && k < cached.size(); k++) {
+        size_t first = k * cached.size() / BEATSTEP_SHADOW_SENTINELS;
+        size_t last = std::max(first + 1, (k + 1) * cached.size() / BEATSTEP_SHADOW_SENTINELS);
+        size_t n = first + random() % (last - first);
+        sentinels.push_back(n);
+        addresses.push_back({ cached[n].cc, cached[n].pp });
+      }
+      std::vector<BeatstepReading> readings = this->getMany(addresses);
+      for (size_t n = 0; n < readings.size(); n++) {
+        if (!readings[n].ok || readings[n].value != cached[sentinels[n]].value) {
+          // changed behind our back (say, a preset was recalled on the device), so none of it can be trusted
+          this->shadowStale = true;
+          return false;
+        }
       }
+      this->shadowChecked = std::time(nullptr);
+      this->rememberShadow(cached);
+      return true;
+    }
 
-      k = "global_" + std::to_string(0x05) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x05, 0x52, j[k]);
+    // the id of the device on this port whose shadow passed its check most recently ("" if there's none)
+    // with recent, only if that was in the last BEATSTEP_SHADOW_TRUST seconds
+    std::string portShadow (const json &j, bool recent) {
+      long long now = std::time(nullptr);
+      long long newest = -1;
+      std::string id;
+      for (auto it = j.begin(); it != j.end(); it++) {
+        const json &saved = it.value();
+        if (!saved.is_object() || !saved.contains("port") || saved["port"] != this->portName) {
+          continue;
+        }
+        long long checked = 0;
+        if (saved.contains("checked") && saved["checked"].is_number_unsigned()) {
+          checked = saved["checked"].get<long long>();
+        }
+        if (recent && (!checked || checked > now || now - checked >= BEATSTEP_SHADOW_TRUST)) {
+          continue;
+        }
+        if (checked > newest) {
+          newest = checked;
+          id = it.key();
+        }
       }
+      return id;
+    }
 
-      k = "global_" + std::to_string(0x05) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x05, 0x53, j[k]);
+    // take cached values into the shadow, where nothing is known yet
+    void rememberShadow (const std::vector<BeatstepSetting> &cached) {
+      std::lock_guard<std::mutex> lock(this->shadowLock);
+      for (const BeatstepSetting &c : cached) {
+        short &known = this->shadow[shadowSlot(c.cc, c.pp)];
+        if (known == BEATSTEP_SHADOW_UNKNOWN) {
+          known = c.value;
+        }
       }
+    }
 
-      k = "global_" + std::to_string(0x06) + "_" + std::to_string(0x40);
-      if (j.contains(k)) {
-        this->set(0x06, 0x40, j[k]);
+    // what's saved for one device in shadow.json ({"port", "checked", "values"}), if every value is a real
+    // [cc, pp, value] (one bad entry means the file was damaged or edited, so none of it is used)
+    // checked is when it last passed the sentinel check (in seconds since the epoch), or 0
+    static bool readShadow (const json &saved, std::vector<BeatstepSetting> &out, long long &checked) {
+      if (!saved.is_object() || !saved.contains("values") || !saved["values"].is_array()) {
+        return false;
       }
+      checked = 0;
+      if (saved.contains("checked")) {
+        if (!saved["checked"].is_number_unsigned()) {
+          return false;
+        }
+        checked = saved["checked"].get<long long>();
+      }
+      for (const json &entry : saved["values"]) {
+        if (!entry.is_array() || entry.size() != 3) {
+          return false;
+        }
+        for (const json &n : entry) {
+          if (!n.is_number_unsigned() || n.get<unsigned long long>() > 0x7F) {
+            return false;
+          }
+        }
+        out.push_back({ entry[0].get<unsigned char>(), entry[1].get<unsigned char>(), entry[2].get<unsigned char>() });
+      }
+      return true;
+    }
 
-      k = "global_" + std::to_string(0x06) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x06, 0x50, j[k]);
+    // remember everything we know about this device's values, for next time
+    // (added to what was saved before, unless loadShadow found that out of date)
+    // this never asks the device who it is: if nothing has this run, it goes with what was last saved for
+    // this port, and if there's nothing, it's not saved (a save or load --diff will start one)
+    void saveShadow () {
+      std::string filename = cachePath("shadow.json");
+      json j;
+      {
+        std::ifstream i(filename);
+        if (i) {
+          j = json::parse(i, nullptr, false);
+        }
+      }
+      if (!j.is_object()) {
+        j = json::object();
+      }
+      std::string id = this->identity.empty() ? this->portShadow(j, false) : this->identity;
+      if (id.empty()) {
+        return;
       }
 
-      k = "global_" + std::to_string(0x06) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x06, 0x52, j[k]);
+      std::vector<short> merged(BEATSTEP_SHADOW_SIZE, BEATSTEP_SHADOW_UNKNOWN);
+      std::vector<BeatstepSetting> saved;
+      long long checked = 0;
+      if (!this->shadowStale && j.contains(id) && readShadow(j[id], saved, checked)) {
+        for (const BeatstepSetting &c : saved) {
+          merged[shadowSlot(c.cc, c.pp)] = c.value;
+        }
+      }
+      if (this->shadowChecked) {
+        checked = this->shadowChecked;
+      } else if (this->shadowStale) {
+        checked = 0;
+      }
+      {
+        std::lock_guard<std::mutex> lock(this->shadowLock);
+        for (size_t a = 0; a < BEATSTEP_SHADOW_SIZE; a++) {
+          if (this->shadow[a] != BEATSTEP_SHADOW_UNKNOWN) {
+            merged[a] = this->shadow[a];
+          }
+        }
       }
 
-      k = "global_" + std::to_string(0x06) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x06, 0x53, j[k]);
+      json entries = json::array();
+      for (size_t a = 0; a < BEATSTEP_SHADOW_SIZE; a++) {
+        if (merged[a] != BEATSTEP_SHADOW_UNKNOWN) {
+          entries.push_back({ a & 0xFF, a >> 8, merged[a] });
+        }
       }
+      j[id] = { { "port", this->portName }, { "checked", checked }, { "values", entries } };
 
-      k = "global_" + std::to_string(0x07) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x07, 0x50, j[k]);
+      std::string temporary = filename + ".tmp";
+      {
+        std::ofstream o(temporary);
+        o << j << std::endl;
       }
+      beatstepReplaceFile(temporary, filename);
+    }
 
-      k = "global_" + std::to_string(0x07) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x07, 0x52, j[k]);
+    // where a cached file lives (the directory is created if needed)
+    static std::string cachePath (std::string name) {
+      std::string dir;
+      const char *xdg = getenv("XDG_CACHE_HOME");
+      const char *home = getenv("HOME");
+      const char *local = getenv("LOCALAPPDATA");
+      if (xdg && *xdg) {
+        dir = xdg;
+      } else if (local && *local) {
+        dir = local;
+      } else if (home && *home) {
+        dir = std::string(home) + "/.cache";
+      } else {
+        dir = ".";
+      }
+      dir += "/beatstep";
+      for (size_t i = 1; i <= dir.size(); i++) {
+        if (i == dir.size() || dir[i] == '/') {
+          MKDIR(dir.substr(0, i).c_str());
+        }
       }
+      return dir + "/" + name;
+    }
+
+    // set the color of a pad's LED
+    void color (unsigned char pad, BeatstepColor color) {
+      this->set(pad, 0x10, color);
+    }
+
+    // update firmware
+    bool updateFirmware (std::string filename){
+      std::ifstream input(filename, std::ios::binary);
+      std::vector<unsigned char> buffer(std::istreambuf_iterator<char>(input), {});
+
+      // TODO: no iddea how to turn led into sysex, can't seem to capture it either
 
-      k = "global_" + std::to_string(0x07) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x07, 0x53, j[k]);
+      return true;
+    }
+
+    // get the firmware version on the device
+    std::vector<unsigned char> version(unsigned int timeoutMs = 100) {
+      std::vector<unsigned char> version = {0,0,0,0};
+      BeatstepWaiter waiter;
+      WaiterGuard guard = { this, &waiter, 1 };
+
+      this->expect(BEATSTEP_KEY_IDENTITY, &waiter);
+      this->send(BEATSTEP_IDENTITY_REQUEST.data(), BEATSTEP_IDENTITY_REQUEST.size());
+
+      if (this->await(&waiter, std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs))) {
+        version[0] = waiter.reply[15];
+        version[1] = waiter.reply[14];
+        version[2] = waiter.reply[13];
+        version[3] = waiter.reply[12];
+      } else {
+        this->forget(&waiter);
       }
+      guard.dismiss();
 
-      k = "global_" + std::to_string(0x08) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x08, 0x50, j[k]);
+      return version;
+    }
+
+    // get a setting
+    unsigned char get (unsigned char cc, unsigned char pp, unsigned int timeoutMs = 100) {
+      beatstepCheckAddress(cc, pp);
+      BeatstepFrame<11> message = beatstepGetFrame(cc, pp);
+      BeatstepWaiter waiter;
+      WaiterGuard guard = { this, &waiter, 1 };
+
+      this->expect((pp << 8) | cc, &waiter);
+      this->send(message.data(), message.size());
+
+      if (!this->await(&waiter, std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs))) {
+        this->forget(&waiter);
+        guard.dismiss();
+        throw std::invalid_argument("No response: " + std::to_string(cc) + ":" + std::to_string(pp));
       }
+      guard.dismiss();
+
+      this->remember(cc, pp, waiter.reply[10]);
+      return waiter.reply[10];
+    }
 
-      k = "global_" + std::to_string(0x08) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x08, 0x52, j[k]);
+    // get many settings, keeping up to window requests in flight at once
+    // replies are matched on their address, so they can arrive in any order
+    std::vector<BeatstepReading> getMany (const std::vector<BeatstepAddress> &addresses, unsigned int window = 16, unsigned int timeoutMs = 100) {
+      return this->getMany(addresses, window, timeoutMs, nullptr);
+    }
+
+    // same, but onReading is called with each reading (and its index in addresses) as soon as it's settled,
+    // in whatever order replies come back
+    std::vector<BeatstepReading> getMany (const std::vector<BeatstepAddress> &addresses, unsigned int window, unsigned int timeoutMs, std::function<void(size_t index, const BeatstepReading &reading)> onReading) {
+      typedef std::chrono::steady_clock clock;
+      std::vector<BeatstepReading> readings;
+      std::vector<BeatstepWaiter> waiters(addresses.size());
+      std::vector<clock::time_point> deadlines(addresses.size());
+      std::vector<size_t> inflight;
+      // (onReading can throw too)
+      WaiterGuard guard = { this, waiters.data(), waiters.size() };
+      size_t next = 0;
+      size_t done = 0;
+
+      if (window < 1) {
+        window = 1;
       }
+      inflight.reserve(window);
 
-      k = "global_" + std::to_string(0x08) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x08, 0x53, j[k]);
+      for (size_t i = 0; i < addresses.size(); i++) {
+        beatstepCheckAddress(addresses[i].cc, addresses[i].pp);
+        readings.push_back({ addresses[i], 0, false });
       }
 
-      k = "global_" + std::to_string(0x09) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x09, 0x50, j[k]);
+      while (done < addresses.size()) {
+        // top up the window
+        while (next < addresses.size() && inflight.size() < window) {
+          BeatstepAddress a = addresses[next];
+          bool busy = false;
+          for (size_t i : inflight) {
+            busy = busy || (addresses[i].cc == a.cc && addresses[i].pp == a.pp);
+          }
+          if (busy) {
+            // same address is already waiting on a reply, so wait for that first
+            break;
+          }
+          BeatstepFrame<11> message = beatstepGetFrame(a.cc, a.pp);
+          this->expect((a.pp << 8) | a.cc, &waiters[next]);
+          this->send(message.data(), message.size());
+          deadlines[next] = clock::now() + std::chrono::milliseconds(timeoutMs);
+          inflight.push_back(next);
+          next++;
+        }
+
+        // sleep until something in the window is answered, or the oldest request expires
+        std::unique_lock<std::mutex> lock(this->replyLock);
+        this->replyReady.wait_until(lock, deadlines[inflight.front()], [&]{
+          for (size_t i : inflight) {
+            if (waiters[i].done) {
+              return true;
+            }
+          }
+          return false;
+        });
+        lock.unlock();
+
+        // collect replies, and give up on anything past its deadline
+        clock::time_point now = clock::now();
+        for (auto it = inflight.begin(); it != inflight.end();) {
+          size_t i = *it;
+          lock.lock();
+          bool answered = waiters[i].done;
+          lock.unlock();
+          if (answered) {
+            readings[i].value = waiters[i].reply[10];
+            readings[i].ok = true;
+            this->remember(addresses[i].cc, addresses[i].pp, readings[i].value);
+          } else if (now >= deadlines[i]) {
+            this->forget(&waiters[i]);
+          } else {
+            it++;
+            continue;
+          }
+          it = inflight.erase(it);
+          done++;
+          if (onReading) {
+            onReading(i, readings[i]);
+          }
+        }
       }
+      guard.dismiss();
+
+      return readings;
+    }
 
-      k = "global_" + std::to_string(0x09) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x09, 0x52, j[k]);
+    // get a setting, without waiting for it (the future throws if the device never answers)
+    std::future<unsigned char> getAsync (unsigned char cc, unsigned char pp) {
+      std::shared_ptr<std::promise<unsigned char>> promise = std::make_shared<std::promise<unsigned char>>();
+      this->getAsync(cc, pp, [promise, cc, pp](bool ok, unsigned char value) {
+        if (ok) {
+          promise->set_value(value);
+        } else {
+          promise->set_exception(std::make_exception_ptr(std::invalid_argument("No response: " + std::to_string(cc) + ":" + std::to_string(pp))));
+        }
+      }, [promise](std::exception_ptr error) {
+        promise->set_exception(error);
+      });
+      return promise->get_future();
+    }
+
+    // get a setting, and call done (on the I/O thread) once it's in
+    // if reading throws (say, the transport failed), failed gets the exception, or without it done gets not ok
+    void getAsync (unsigned char cc, unsigned char pp, std::function<void(bool ok, unsigned char value)> done, std::function<void(std::exception_ptr error)> failed = nullptr) {
+      beatstepCheckAddress(cc, pp);
+      BeatstepJob job = { BEATSTEP_JOB_GET, { cc, pp, 0 }, done, nullptr, failed };
+      this->queue(job);
+    }
+
+    // set a param, without waiting for it to go out
+    std::future<void> setAsync (unsigned char cc, unsigned char pp, unsigned char vv) {
+      std::shared_ptr<std::promise<void>> promise = std::make_shared<std::promise<void>>();
+      this->setAsync(cc, pp, vv, [promise](bool, unsigned char) {
+        promise->set_value();
+      }, [promise](std::exception_ptr error) {
+        promise->set_exception(error);
+      });
+      return promise->get_future();
+    }
+
+    // set a param, and call done (on the I/O thread) once it's been sent
+    // if sending throws, failed gets the exception, or without it done gets not ok
+    void setAsync (unsigned char cc, unsigned char pp, unsigned char vv, std::function<void(bool ok, unsigned char value)> done, std::function<void(std::exception_ptr error)> failed = nullptr) {
+      beatstepCheckSetting(cc, pp, vv);
+      BeatstepJob job = { BEATSTEP_JOB_SET, { cc, pp, vv }, done, nullptr, failed };
+      this->queue(job);
+    }
+
+    // get the firmware version, without waiting for it
+    std::future<std::vector<unsigned char>> versionAsync () {
+      std::shared_ptr<std::promise<std::vector<unsigned char>>> promise = std::make_shared<std::promise<std::vector<unsigned char>>>();
+      this->versionAsync([promise](std::vector<unsigned char> v) {
+        promise->set_value(v);
+      }, [promise](std::exception_ptr error) {
+        promise->set_exception(error);
+      });
+      return promise->get_future();
+    }
+
+    // get the firmware version, and call done (on the I/O thread) once it's in
+    // if asking throws, failed gets the exception, or without it done gets 0.0.0.0 (as when there's no answer)
+    void versionAsync (std::function<void(std::vector<unsigned char> version)> done, std::function<void(std::exception_ptr error)> failed = nullptr) {
+      BeatstepJob job = { BEATSTEP_JOB_VERSION, { 0, 0, 0 }, nullptr, done, failed };
+      this->queue(job);
+    }
+
+    // hand a job to the I/O thread (starting it, the first time)
+    void queue (BeatstepJob &job) {
+      std::lock_guard<std::mutex> lock(this->jobLock);
+      if (!this->ioThread.joinable()) {
+        this->ioThread = std::thread(&BeatStep::work, this);
       }
+      this->jobs.push_back(std::move(job));
+      this->jobReady.notify_one();
+    }
 
-      k = "global_" + std::to_string(0x09) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x09, 0x53, j[k]);
+    // the I/O thread: runs queued jobs in order, pipelining runs of gets and coalescing runs of sets
+    void work () {
+      this->promote("I/O");
+      std::deque<BeatstepJob> batch;
+      std::vector<BeatstepAddress> addresses;
+      std::vector<BeatstepSetting> settings;
+
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(this->jobLock);
+          this->jobReady.wait(lock, [this]{ return this->stopping || !this->jobs.empty(); });
+          if (this->jobs.empty()) {
+            return;
+          }
+          batch.swap(this->jobs);
+        }
+
+        while (!batch.empty()) {
+          BeatstepJobType type = batch.front().type;
+          size_t n = 1;
+          while (n < batch.size() && batch[n].type == type && type != BEATSTEP_JOB_VERSION) {
+            n++;
+          }
+
+          // whatever throws here goes to each job's caller, instead of taking down the whole process
+          std::exception_ptr error;
+          std::vector<BeatstepReading> readings;
+          std::vector<unsigned char> v;
+          try {
+            if (type == BEATSTEP_JOB_GET) {
+              addresses.clear();
+              for (size_t i = 0; i < n; i++) {
+                addresses.push_back({ batch[i].setting.cc, batch[i].setting.pp });
+              }
+              readings = this->getMany(addresses);
+            } else if (type == BEATSTEP_JOB_SET) {
+              settings.clear();
+              for (size_t i = 0; i < n; i++) {
+                settings.push_back(batch[i].setting);
+              }
+              this->setMany(settings);
+            } else {
+              v = this->version();
+            }
+          } catch (...) {
+            error = std::current_exception();
+          }
+
+          for (size_t i = 0; i < n; i++) {
+            const BeatstepJob &job = batch[i];
+            if (error && job.onError) {
+              job.onError(error);
+            } else if (type == BEATSTEP_JOB_VERSION) {
+              if (job.onVersion) {
+                job.onVersion(error ? std::vector<unsigned char>(4, 0) : v);
+              }
+            } else if (job.onValue) {
+              if (error) {
+                job.onValue(false, 0);
+              } else if (type == BEATSTEP_JOB_GET) {
+                job.onValue(readings[i].ok, readings[i].value);
+              } else {
+                job.onValue(true, job.setting.value);
+              }
+            }
+          }
+
+          batch.erase(batch.begin(), batch.begin() + n);
+        }
       }
+    }
 
-      k = "global_" + std::to_string(0x0A) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x0A, 0x50, j[k]);
+    // every address that is saved in a preset, in file order
+    static std::vector<BeatstepAddress> presetAddresses () {
+      std::vector<BeatstepAddress> addresses;
+      addresses.reserve(BEATSTEP_PARAMS.size());
+      for (const BeatstepParam &p : BEATSTEP_PARAMS) {
+        addresses.push_back({ p.cc, p.pp });
       }
+      return addresses;
+    }
 
-      k = "global_" + std::to_string(0x0A) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x0A, 0x52, j[k]);
+    // read every preset param from the device
+    BeatstepPreset readPreset (unsigned int window = 16) {
+      BeatstepPreset preset = beatstepEmptyPreset();
+      std::vector<BeatstepReading> readings = this->getMany(presetAddresses(), window);
+      for (size_t i = 0; i < readings.size(); i++) {
+        const BeatstepReading &r = readings[i];
+        if (!r.ok) {
+          throw std::invalid_argument("No response: " + std::to_string(r.address.cc) + ":" + std::to_string(r.address.pp));
+        }
+        preset.values[i] = r.value;
       }
+      return preset;
+    }
 
-      k = "global_" + std::to_string(0x0A) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x0A, 0x53, j[k]);
+    // save preset (by default, the format comes from the filename: .bsp, .msgpack, .cbor or JSON)
+    // values go into FILE.partial as they arrive, and FILE is only replaced (atomically) once there are all
+    // of them; if some don't answer, the partial file is kept, and resume only reads what it's missing
+    // (if there's no partial file, resume is an ordinary save of everything)
+    // with a mask, only those params are read (and saved), and anything the shadow knows isn't read again
+    bool savePreset (std::string filename, unsigned int window = 16, BeatstepPresetFormat format = BEATSTEP_PRESET_AUTO, bool resume = false, const BeatstepMask &mask = BEATSTEP_MASK_ALL) {
+      std::string partialName = filename + ".partial";
+      this->lastSave = { 0, 0, 0, 0, 0, 0, false, 0 };
+      resume = resume && std::ifstream(partialName).good();
+      BeatstepPreset preset = resume ? beatstepReadPreset(partialName, BEATSTEP_PRESET_BINARY) : beatstepEmptyPreset();
+      if (format == BEATSTEP_PRESET_AUTO) {
+        format = beatstepPresetFormatFor(filename);
       }
 
-      k = "global_" + std::to_string(0x0B) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x0B, 0x50, j[k]);
+      std::vector<BeatstepAddress> missing;
+      std::vector<size_t> slots;
+      for (size_t i = 0; i < BEATSTEP_PARAMS.size(); i++) {
+        if (!mask[i] || preset.values[i] != BEATSTEP_PRESET_UNSET) {
+          continue;
+        }
+        int value = this->known(BEATSTEP_PARAMS[i].cc, BEATSTEP_PARAMS[i].pp);
+        if (value != BEATSTEP_SHADOW_UNKNOWN) {
+          preset.values[i] = value;
+          this->lastSave.skipped++;
+        } else {
+          missing.push_back({ BEATSTEP_PARAMS[i].cc, BEATSTEP_PARAMS[i].pp });
+          slots.push_back(i);
+        }
       }
 
-      k = "global_" + std::to_string(0x0B) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x0B, 0x52, j[k]);
+      this->lastSave.read = missing.size();
+
+      // the partial file is a binary preset, so each value can be written in place as it comes in
+      std::string failed;
+      unsigned int failures = 0;
+      {
+        std::ofstream partial(partialName, std::ios::binary);
+        if (!partial) {
+          throw std::invalid_argument("Could not write: " + partialName);
+        }
+        partial.write((const char *)&preset, sizeof(preset));
+        partial.flush();
+        this->getMany(missing, window, 100, [&](size_t n, const BeatstepReading &r) {
+          if (!r.ok) {
+            if (!failures++) {
+              failed = std::to_string(r.address.cc) + ":" + std::to_string(r.address.pp);
+            }
+            return;
+          }
+          preset.values[slots[n]] = r.value;
+          partial.seekp(sizeof(preset.header) + slots[n]);
+          partial.put(r.value);
+          partial.flush();
+        });
+      }
+      if (failures) {
+        throw std::invalid_argument("No response: " + failed + " (and " + std::to_string(failures - 1) + " more), the rest is in " + partialName + " (save --resume to finish it)");
       }
 
-      k = "global_" + std::to_string(0x0B) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x0B, 0x53, j[k]);
+      if (format == BEATSTEP_PRESET_BINARY) {
+        std::vector<unsigned char> v = this->version();
+        std::copy(v.begin(), v.begin() + 4, preset.header.firmware);
       }
+      beatstepWritePreset(filename, preset, format);
+      std::remove(partialName.c_str());
 
-      k = "global_" + std::to_string(0x0C) + "_" + std::to_string(0x50);
-      if (j.contains(k)) {
-        this->set(0x0C, 0x50, j[k]);
+      return true;
+    }
+
+    // load preset (by default, the format is detected from the file)
+    // with diff, values the device already has are left out (anything not in the shadow is read first)
+    // with a mask, only those params are loaded
+    // with verify, everything written is read back, and mismatches are written again (returns false if some never stick)
+    // with a verify sample, just that many are read back, unless one of them is wrong
+    bool loadPreset (std::string filename, bool diff = false, unsigned int window = 16, BeatstepPresetFormat format = BEATSTEP_PRESET_AUTO, const BeatstepMask &mask = BEATSTEP_MASK_ALL, bool verify = false, unsigned int sample = 0){
+      this->applyPreset(beatstepReadPreset(filename, format), diff, window, mask, verify, sample);
+      return this->lastLoad.failed == 0;
+    }
+
+    // send every value a preset sets (that's in the mask), in one paced batch
+    void applyPreset (const BeatstepPreset &preset, bool diff = false, unsigned int window = 16, const BeatstepMask &mask = BEATSTEP_MASK_ALL, bool verify = false, unsigned int sample = 0) {
+      std::vector<BeatstepSetting> settings;
+      settings.reserve(BEATSTEP_PARAMS.size());
+      for (size_t i = 0; i < BEATSTEP_PARAMS.size(); i++) {
+        if (mask[i] && preset.values[i] != BEATSTEP_PRESET_UNSET) {
+          settings.push_back({ BEATSTEP_PARAMS[i].cc, BEATSTEP_PARAMS[i].pp, preset.values[i] });
+        }
       }
 
-      k = "global_" + std::to_string(0x0C) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x0C, 0x52, j[k]);
+      this->lastLoad = { 0, 0, 0, 0, 0, 0, false, 0 };
+      if (diff) {
+        settings = this->changed(settings, window);
       }
+      this->setMany(settings);
+      this->lastLoad.written = settings.size();
+
+      this->lastVerify.clear();
+      if (verify && sample && sample < settings.size()) {
+        this->lastVerify = this->verifySample(settings, sample, window);
+        for (const BeatstepVerifyResult &r : this->lastVerify) {
+          this->lastLoad.retried += r.tries > 1;
+          this->lastLoad.failed += !r.ok;
+        }
+      } else if (verify) {
+        this->lastVerify = this->verify(settings, window);
+        for (const BeatstepVerifyResult &r : this->lastVerify) {
+          this->lastLoad.retried += r.tries > 1;
+          this->lastLoad.failed += !r.ok;
+        }
+      }
+    }
 
-      k = "global_" + std::to_string(0x0C) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x0C, 0x53, j[k]);
+    // read back a stratified sample of settings that were just written (one from each of `sample` equal runs
+    // of them, so every part of the preset gets looked at), and only if one is wrong, verify all of them
+    std::vector<BeatstepVerifyResult> verifySample (const std::vector<BeatstepSetting> &settings, unsigned int sample, unsigned int window = 16) {
+      std::mt19937 random(std::random_device{}());
+      std::vector<size_t> picked;
+      std::vector<BeatstepAddress> addresses;
+      for (unsigned int k = 0; k < sample; k++) {
+        size_t first = k * settings.size() / sample;
+        size_t last = (k + 1) * settings.size() / sample;
+        size_t i = first + random() % (last - first);
+        picked.push_back(i);
+        addresses.push_back({ settings[i].cc, settings[i].pp });
       }
 
-      k = "global_" + std::to_string(0x0D) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x0D, 0x52, j[k]);
+      this->lastLoad.sampled = sample;
+      std::vector<BeatstepReading> readback = this->getMany(addresses, window);
+      bool clean = true;
+      for (size_t n = 0; n < readback.size(); n++) {
+        clean = clean && readback[n].ok && readback[n].value == settings[picked[n]].value;
+      }
+      if (!clean) {
+        this->lastLoad.escalated = true;
+        return this->verify(settings, window);
       }
 
-      k = "global_" + std::to_string(0x0D) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x0D, 0x53, j[k]);
+      std::vector<BeatstepVerifyResult> results;
+      for (const BeatstepSetting &setting : settings) {
+        results.push_back({ setting, false, true, true, setting.value, 1 });
+      }
+      for (size_t n = 0; n < readback.size(); n++) {
+        results[picked[n]].checked = true;
       }
+      this->lastLoad.bound = beatstepSampleBound(settings.size(), sample);
+      return results;
+    }
 
-      k = "global_" + std::to_string(0x0E) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x0E, 0x52, j[k]);
+    // read back settings that were just written, in one pipelined pass, then write & read again just the ones
+    // that didn't stick (waiting longer, and slowing the pacer, each time)
+    std::vector<BeatstepVerifyResult> verify (const std::vector<BeatstepSetting> &settings, unsigned int window = 16, unsigned int tries = BEATSTEP_VERIFY_TRIES) {
+      std::vector<BeatstepVerifyResult> results;
+      std::vector<size_t> pending;
+      for (size_t i = 0; i < settings.size(); i++) {
+        results.push_back({ settings[i], true, false, false, 0, 1 });
+        pending.push_back(i);
       }
 
-      k = "global_" + std::to_string(0x0E) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x0E, 0x53, j[k]);
+      for (unsigned int attempt = 0; attempt < tries && !pending.empty(); attempt++) {
+        std::vector<BeatstepAddress> addresses;
+        std::vector<BeatstepSetting> again;
+        for (size_t i : pending) {
+          addresses.push_back({ settings[i].cc, settings[i].pp });
+          again.push_back(settings[i]);
+        }
+        if (attempt) {
+          unsigned int wait = BEATSTEP_VERIFY_BACKOFF_MS << (attempt - 1);
+          SLEEP(wait);
+          this->pacer.backoff();
+          this->setMany(again);
+          for (size_t i : pending) {
+            results[i].tries++;
+          }
+        }
+
+        std::vector<BeatstepReading> readback = this->getMany(addresses, window);
+        std::vector<size_t> wrong;
+        for (size_t n = 0; n < readback.size(); n++) {
+          BeatstepVerifyResult &r = results[pending[n]];
+          r.answered = readback[n].ok;
+          r.got = readback[n].value;
+          r.ok = r.answered && r.got == r.setting.value;
+          if (!r.ok) {
+            wrong.push_back(pending[n]);
+          }
+        }
+        pending = wrong;
       }
 
-      k = "global_" + std::to_string(0x0F) + "_" + std::to_string(0x52);
-      if (j.contains(k)) {
-        this->set(0x0F, 0x52, j[k]);
+      return results;
+    }
+
+    // just the settings the device doesn't already have
+    std::vector<BeatstepSetting> changed (const std::vector<BeatstepSetting> &settings, unsigned int window = 16) {
+      std::vector<BeatstepAddress> unknown;
+      for (const BeatstepSetting &s : settings) {
+        if (this->known(s.cc, s.pp) == BEATSTEP_SHADOW_UNKNOWN) {
+          unknown.push_back({ s.cc, s.pp });
+        }
+      }
+      // this fills in the shadow (anything that doesn't answer stays unknown, so it gets written)
+      this->getMany(unknown, window);
+      this->lastLoad.read = unknown.size();
+
+      std::vector<BeatstepSetting> out;
+      for (const BeatstepSetting &s : settings) {
+        if (this->known(s.cc, s.pp) == s.value) {
+          this->lastLoad.skipped++;
+        } else {
+          out.push_back(s);
+        }
       }
+      return out;
+    }
 
-      k = "global_" + std::to_string(0x0F) + "_" + std::to_string(0x53);
-      if (j.contains(k)) {
-        this->set(0x0F, 0x53, j[k]);
+    // the last value we know the device has at cc:pp (or BEATSTEP_SHADOW_UNKNOWN)
+    int known (unsigned char cc, unsigned char pp) {
+      std::lock_guard<std::mutex> lock(this->shadowLock);
+      return this->shadow[shadowSlot(cc, pp)];
+    }
+
+    void remember (unsigned char cc, unsigned char pp, unsigned char value) {
+      std::lock_guard<std::mutex> lock(this->shadowLock);
+      this->shadow[shadowSlot(cc, pp)] = value;
+    }
+
+    // the value at cc:pp from the shadow if it's known, otherwise from the device
+    unsigned char getCached (unsigned char cc, unsigned char pp, unsigned int timeoutMs = 100) {
+      int value = this->known(cc, pp);
+      if (value != BEATSTEP_SHADOW_UNKNOWN) {
+        return value;
       }
+      return this->get(cc, pp, timeoutMs);
+    }
 
-      return true;
+    // where cc:pp lives in the shadow (every index into it goes through here)
+    static size_t shadowSlot (unsigned char cc, unsigned char pp) {
+      beatstepCheckAddress(cc, pp);
+      return (pp << 8) | cc;
+    }
+
+    // stop trusting the shadow (say, after someone changed things on the device itself)
+    void forgetShadow () {
+      std::lock_guard<std::mutex> lock(this->shadowLock);
+      std::fill(this->shadow, this->shadow + BEATSTEP_SHADOW_SIZE, BEATSTEP_SHADOW_UNKNOWN);
     }
 
     // enter update mode (requires unplug/replug)
@@ -599,7 +1483,7 @@ class BeatStep {
        In:  F0  15  F7  |  Sysex
       */
       std::vector<unsigned char> message = {0xF0, 0x5A, 0x57, 0x6E, 0x28, 0x3C, 0x4E, 0x3C, 0xF7};
-      this->midiout->sendMessage(&message);
+      this->send(message.data(), message.size());
       SLEEP(1);
     }
 
@@ -623,6 +1507,60 @@ class BeatStep {
       this->set(0x06, control, mode);
     }
     
-    RtMidiOut *midiout;
-    RtMidiIn *midiin;
+    BeatstepTransport *transport;
+    BeatstepPacer pacer;
+    std::string portName;
+
+    // hand-off from the MIDI thread
+    BeatstepRing<BeatstepSysexSlot, BEATSTEP_SYSEX_SLOTS> replies;
+    BeatstepRing<BeatstepEvent, BEATSTEP_EVENT_SLOTS> events;
+
+    // how long replies wait between the transport and the dispatcher
+    BeatstepLatency dispatchLatency;
+
+    // what the last loadPreset did
+    BeatstepLoadStats lastLoad = { 0, 0, 0, 0, 0, 0, false, 0 };
+
+    // how many values the last savePreset read, and how many came from the shadow
+    BeatstepLoadStats lastSave = { 0, 0, 0, 0, 0, 0, false, 0 };
+
+    // with verify, what happened to each value the last loadPreset wrote
+    std::vector<BeatstepVerifyResult> lastVerify;
+
+  private:
+    std::mutex replyLock;
+    std::condition_variable replyReady;
+    BeatstepWaiter *waiters = nullptr;
+    std::vector<unsigned char> sendBuffer;
+
+    // what we last read from or wrote to each address
+    std::mutex shadowLock;
+    short shadow[BEATSTEP_SHADOW_SIZE];
+    bool shadowStale = false;
+    // when the shadow last passed loadShadow's check (seconds since the epoch), or 0 if it hasn't this run
+    long long shadowChecked = 0;
+
+    // portName & firmware, once deviceId has asked for it (or loadShadow has taken it from the cache)
+    std::string identity;
+    bool identityAsked = false;
+    BeatstepParser parser;
+    std::mutex sendLock;
+    BeatstepCaptureWriter *capture = nullptr;
+
+    std::thread ioThread;
+    std::mutex jobLock;
+    std::condition_variable jobReady;
+    std::deque<BeatstepJob> jobs;
+    bool stopping = false;
+
+    std::thread dispatchThread;
+    BeatstepSemaphore wake;
+    std::atomic<bool> parked{false};
+    std::atomic<bool> closing{false};
+
+    BeatstepRealtimeOptions realtime;
+    std::atomic<bool> receiverPromoted{false};
+    std::mutex realtimeLock;
+    unsigned int realtimeThreads = 0;
+    std::vector<std::string> realtimeProblems;
 };
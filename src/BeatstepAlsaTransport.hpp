@@ -0,0 +1,253 @@
+#pragma once
+
+// talks to the ALSA sequencer directly (Linux only, built when ALSA is found)
+// compared to RtMidi, there is no extra queue or per-message vector: the reader thread sleeps in
+// poll() on non-blocking fds, drains every waiting event per wakeup, and a batch of outgoing
+// messages is flushed to the kernel with one drain
+
+#include "BeatstepTransport.hpp"
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <stdexcept>
+
+// biggest sysex we encode in one go (the encoder grows past this if it has to)
+#define BEATSTEP_ALSA_BUFFER 4096
+
+class BeatstepAlsaTransport : public BeatstepTransport {
+  public:
+    BeatstepAlsaTransport () {
+      int err = snd_seq_open(&this->seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK);
+      if (err < 0) {
+        throw std::runtime_error(std::string("ALSA: could not open sequencer: ") + snd_strerror(err));
+      }
+      snd_seq_set_client_name(this->seq, "BeatStep CLI");
+      snd_seq_set_output_buffer_size(this->seq, 64 * 1024);
+      snd_seq_set_input_buffer_size(this->seq, 64 * 1024);
+      snd_midi_event_new(BEATSTEP_ALSA_BUFFER, &this->encoder);
+      snd_midi_event_new(BEATSTEP_ALSA_BUFFER, &this->decoder);
+      snd_midi_event_no_status(this->decoder, 1);
+      if (pipe(this->wake) < 0) {
+        throw std::runtime_error("ALSA: could not make wake-pipe");
+      }
+    }
+
+    ~BeatstepAlsaTransport () {
+      this->stopInput();
+      close(this->wake[0]);
+      close(this->wake[1]);
+      snd_midi_event_free(this->encoder);
+      snd_midi_event_free(this->decoder);
+      snd_seq_close(this->seq);
+    }
+
+    unsigned int portCount () {
+      return this->ports().size();
+    }
+
+    std::string portName (unsigned int port) {
+      std::vector<BeatstepAlsaPort> ports = this->ports();
+      if (port >= ports.size()) {
+        throw std::invalid_argument("ALSA: no port " + std::to_string(port + 1));
+      }
+      return ports[port].name;
+    }
+
+    void openPort (unsigned int port) {
+      std::vector<BeatstepAlsaPort> ports = this->ports();
+      if (port >= ports.size()) {
+        throw std::invalid_argument("ALSA: no port " + std::to_string(port + 1));
+      }
+      this->makePort("BeatStep CLI");
+      snd_seq_connect_to(this->seq, this->port, ports[port].client, ports[port].port);
+      if (ports[port].readable) {
+        snd_seq_connect_from(this->seq, this->port, ports[port].client, ports[port].port);
+      }
+      this->start();
+    }
+
+    void openVirtualPort (std::string name) {
+      this->makePort(name);
+      this->start();
+    }
+
+    // encode everything into events, then hand the whole batch to the kernel at once
+    void send (const unsigned char *data, size_t size) {
+      if (size > this->encoderSize) {
+        snd_midi_event_resize_buffer(this->encoder, size);
+        this->encoderSize = size;
+      }
+      size_t offset = 0;
+      while (offset < size) {
+        snd_seq_event_t ev;
+        snd_seq_ev_clear(&ev);
+        long used = snd_midi_event_encode(this->encoder, data + offset, size - offset, &ev);
+        if (used <= 0) {
+          break;
+        }
+        offset += used;
+        if (ev.type == SND_SEQ_EVENT_NONE) {
+          // incomplete message at the end
+          continue;
+        }
+        snd_seq_ev_set_source(&ev, this->port);
+        snd_seq_ev_set_subs(&ev);
+        snd_seq_ev_set_direct(&ev);
+        while (snd_seq_event_output(this->seq, &ev) == -EAGAIN) {
+          this->flush();
+        }
+      }
+      this->flush();
+    }
+
+    void setReceiver (Receiver receiver, void *userData) {
+      this->receiver = receiver;
+      this->userData = userData;
+    }
+
+    // the receiver is only ever called from the reader thread, so once that's joined it's done
+    void stopInput () {
+      if (this->reader.joinable()) {
+        this->stopping = true;
+        char c = 0;
+        if (write(this->wake[1], &c, 1) < 0) {
+          // reader will still see stopping on its next wakeup
+        }
+        this->reader.join();
+      }
+    }
+
+  private:
+    struct BeatstepAlsaPort {
+      int client;
+      int port;
+      bool readable;
+      std::string name;
+    };
+
+    // every port we can send to, in the same order (and with the same names) RtMidi lists them
+    std::vector<BeatstepAlsaPort> ports () {
+      std::vector<BeatstepAlsaPort> found;
+      snd_seq_client_info_t *cinfo;
+      snd_seq_port_info_t *pinfo;
+      snd_seq_client_info_malloc(&cinfo);
+      snd_seq_port_info_malloc(&pinfo);
+      int me = snd_seq_client_id(this->seq);
+      unsigned int wanted = SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE;
+      unsigned int readable = SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ;
+
+      snd_seq_client_info_set_client(cinfo, -1);
+      while (snd_seq_query_next_client(this->seq, cinfo) >= 0) {
+        int client = snd_seq_client_info_get_client(cinfo);
+        if (client == 0 || client == me) {
+          continue;
+        }
+        snd_seq_port_info_set_client(pinfo, client);
+        snd_seq_port_info_set_port(pinfo, -1);
+        while (snd_seq_query_next_port(this->seq, pinfo) >= 0) {
+          unsigned int type = snd_seq_port_info_get_type(pinfo);
+          unsigned int caps = snd_seq_port_info_get_capability(pinfo);
+          if (!(type & (SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_SYNTH | SND_SEQ_PORT_TYPE_APPLICATION))) {
+            continue;
+          }
+          if ((caps & wanted) != wanted) {
+            continue;
+          }
+          int port = snd_seq_port_info_get_port(pinfo);
+          std::string name = std::string(snd_seq_client_info_get_name(cinfo)) + ":" + snd_seq_port_info_get_name(pinfo) + " " + std::to_string(client) + ":" + std::to_string(port);
+          found.push_back({ client, port, (caps & readable) == readable, name });
+        }
+      }
+
+      snd_seq_port_info_free(pinfo);
+      snd_seq_client_info_free(cinfo);
+      return found;
+    }
+
+    void makePort (std::string name) {
+      this->port = snd_seq_create_simple_port(this->seq, name.c_str(),
+        SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ | SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+        SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+      if (this->port < 0) {
+        throw std::runtime_error(std::string("ALSA: could not make port: ") + snd_strerror(this->port));
+      }
+    }
+
+    // push buffered events to the kernel, waiting for room if it's full
+    void flush () {
+      while (snd_seq_drain_output(this->seq) == -EAGAIN) {
+        this->waitFor(POLLOUT);
+      }
+    }
+
+    void waitFor (short events) {
+      int count = snd_seq_poll_descriptors_count(this->seq, events);
+      std::vector<struct pollfd> fds(count);
+      snd_seq_poll_descriptors(this->seq, fds.data(), count, events);
+      poll(fds.data(), count, 10);
+    }
+
+    void start () {
+      if (!this->reader.joinable()) {
+        this->reader = std::thread(&BeatstepAlsaTransport::listen, this);
+      }
+    }
+
+    // the reader thread: sleep until the sequencer has something, then take everything that's there
+    void listen () {
+      int count = snd_seq_poll_descriptors_count(this->seq, POLLIN);
+      std::vector<struct pollfd> fds(count + 1);
+      snd_seq_poll_descriptors(this->seq, fds.data(), count, POLLIN);
+      fds[count].fd = this->wake[0];
+      fds[count].events = POLLIN;
+
+      unsigned char buffer[BEATSTEP_ALSA_BUFFER];
+      std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+      while (!this->stopping) {
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+          continue;
+        }
+
+        snd_seq_event_t *ev;
+        int left;
+        while ((left = snd_seq_event_input(this->seq, &ev)) >= 0 || left == -ENOSPC) {
+          if (left == -ENOSPC) {
+            // input overran: events were lost, carry on with what's next
+            continue;
+          }
+          std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+          double deltatime = std::chrono::duration<double>(now - last).count();
+          last = now;
+
+          if (!this->receiver) {
+            continue;
+          }
+          if (ev->type == SND_SEQ_EVENT_SYSEX) {
+            // sysex comes through raw, no need to decode
+            this->receiver(deltatime, (const unsigned char *)ev->data.ext.ptr, ev->data.ext.len, this->userData);
+          } else {
+            long size = snd_midi_event_decode(this->decoder, buffer, sizeof(buffer), ev);
+            if (size > 0) {
+              this->receiver(deltatime, buffer, size, this->userData);
+            }
+          }
+        }
+      }
+    }
+
+    snd_seq_t *seq = nullptr;
+    snd_midi_event_t *encoder = nullptr;
+    snd_midi_event_t *decoder = nullptr;
+    size_t encoderSize = BEATSTEP_ALSA_BUFFER;
+    int port = -1;
+    int wake[2];
+    std::thread reader;
+    std::atomic<bool> stopping{false};
+    Receiver receiver = nullptr;
+    void *userData = nullptr;
+};
@@ -0,0 +1,281 @@
+#pragma once
+
+// binary capture of MIDI traffic, cheap enough to leave on at full speed
+// whoever records (a MIDI callback, usually) copies each message into one of a few preallocated buffers,
+// and a writer thread puts full buffers on disk, so recording never waits on the disk or allocates
+// (it does take a lock, so several threads can record, but that's only held for a copy or a buffer swap)
+// (if the writer falls that far behind, messages are dropped & counted instead)
+// a capture is a 16-byte header, then for each message a 12-byte record header and its bytes
+// (see beatstepDescribe / the decode command for reading one)
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "BeatstepSysex.hpp"
+
+#define BEATSTEP_CAPTURE_MAGIC "BSCP"
+#define BEATSTEP_CAPTURE_VERSION 1
+
+// header flags: recorded by the host (beatstep --record), so "out" is to the device; otherwise by an emulator
+#define BEATSTEP_CAPTURE_HOST 0x01
+
+// how big each buffer is, how many there are, and how long a partly-filled one waits before it's written anyway
+#define BEATSTEP_CAPTURE_BUFFER (64 * 1024)
+#define BEATSTEP_CAPTURE_BUFFERS 8
+#define BEATSTEP_CAPTURE_FLUSH_MS 100
+
+// which way a message went, from the point of view of whoever recorded it
+enum BeatstepCaptureDirection {
+  BEATSTEP_CAPTURE_IN,
+  BEATSTEP_CAPTURE_OUT
+};
+
+static const char *BEATSTEP_CAPTURE_DIRECTION_NAMES[] = { "in", "out" };
+
+struct BeatstepCaptureHeader {
+  char magic[4];              // BEATSTEP_CAPTURE_MAGIC
+  unsigned char version;      // BEATSTEP_CAPTURE_VERSION
+  unsigned char flags;        // BEATSTEP_CAPTURE_HOST, or 0
+  unsigned char reserved[2];
+  unsigned char started[8];   // wall-clock time the capture started, in ns since the epoch (little-endian)
+};
+
+struct BeatstepCaptureRecord {
+  unsigned char time[8];      // ns since the capture started, on a monotonic clock (little-endian)
+  unsigned char size[2];      // how many bytes follow (little-endian, longer messages are split over records)
+  unsigned char direction;    // BeatstepCaptureDirection
+  unsigned char port;         // which device, when several are recorded together (emulate --count), otherwise 0
+};
+
+static_assert(sizeof(BeatstepCaptureHeader) == 16, "capture header is 16 bytes");
+static_assert(sizeof(BeatstepCaptureRecord) == 12, "capture record header is 12 bytes");
+
+inline void beatstepPutLE (unsigned char *out, uint64_t value, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    out[i] = (value >> (8 * i)) & 0xFF;
+  }
+}
+
+inline uint64_t beatstepGetLE (const unsigned char *in, size_t size) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < size; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+// a name for a new capture in dir, from the time now: capture-20240131-235959.bscap
+inline std::string beatstepCaptureName (std::string dir) {
+  std::time_t now = std::time(nullptr);
+  char name[32];
+  std::strftime(name, sizeof(name), "capture-%Y%m%d-%H%M%S.bscap", std::localtime(&now));
+  if (!dir.empty() && dir.back() != '/' && dir.back() != '\\') {
+    dir += "/";
+  }
+  return dir + name;
+}
+
+class BeatstepCaptureWriter {
+  public:
+    typedef std::chrono::steady_clock clock;
+
+    BeatstepCaptureWriter (std::string filename, unsigned char flags = 0) {
+      this->filename = filename;
+      this->file = fopen(filename.c_str(), "wb");
+      if (!this->file) {
+        throw std::invalid_argument("Could not write: " + filename);
+      }
+      BeatstepCaptureHeader header = {};
+      memcpy(header.magic, BEATSTEP_CAPTURE_MAGIC, 4);
+      header.version = BEATSTEP_CAPTURE_VERSION;
+      header.flags = flags;
+      beatstepPutLE(header.started, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count(), 8);
+      fwrite(&header, sizeof(header), 1, this->file);
+
+      for (size_t i = 0; i < BEATSTEP_CAPTURE_BUFFERS; i++) {
+        this->buffers[i] = new unsigned char[BEATSTEP_CAPTURE_BUFFER];
+        this->fills[i] = 0;
+        if (i) {
+          this->spare[this->spareCount++] = i;
+        }
+      }
+      this->started = clock::now();
+      this->writer = std::thread(&BeatstepCaptureWriter::drain, this);
+    }
+
+    ~BeatstepCaptureWriter () {
+      this->close();
+      for (size_t i = 0; i < BEATSTEP_CAPTURE_BUFFERS; i++) {
+        delete[] this->buffers[i];
+      }
+    }
+
+    // add a message (from any thread): this only ever copies it into a buffer
+    void record (BeatstepCaptureDirection direction, const unsigned char *data, size_t size, unsigned char port = 0) {
+      uint64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - this->started).count();
+      std::lock_guard<std::mutex> lock(this->bufferLock);
+      do {
+        // a record (header & all) has to fit in one empty buffer
+        size_t most = BEATSTEP_CAPTURE_BUFFER - sizeof(BeatstepCaptureRecord);
+        size_t piece = size < most ? size : most;
+        size_t need = sizeof(BeatstepCaptureRecord) + piece;
+        if (this->fills[this->current] + need > BEATSTEP_CAPTURE_BUFFER) {
+          if (!this->spareCount || this->closing) {
+            this->dropped++;
+            return;
+          }
+          this->hand();
+          if (this->fills[this->current] + need > BEATSTEP_CAPTURE_BUFFER) {
+            this->dropped++;
+            return;
+          }
+        }
+        unsigned char *at = this->buffers[this->current] + this->fills[this->current];
+        BeatstepCaptureRecord *r = (BeatstepCaptureRecord *)at;
+        beatstepPutLE(r->time, time, 8);
+        beatstepPutLE(r->size, piece, 2);
+        r->direction = direction;
+        r->port = port;
+        memcpy(at + sizeof(BeatstepCaptureRecord), data, piece);
+        this->fills[this->current] += need;
+        data += piece;
+        size -= piece;
+      } while (size);
+      this->messages++;
+    }
+
+    // write out whatever is left, and close the file (nothing is recorded after this)
+    void close () {
+      if (!this->writer.joinable()) {
+        return;
+      }
+      {
+        std::lock_guard<std::mutex> lock(this->bufferLock);
+        this->closing = true;
+      }
+      this->bufferReady.notify_one();
+      this->writer.join();
+      fclose(this->file);
+      this->file = nullptr;
+    }
+
+    std::string filename;
+
+    // messages recorded and dropped, bytes written, and the most full buffers that were ever waiting at once
+    std::atomic<unsigned long> messages{0};
+    std::atomic<unsigned long> dropped{0};
+    std::atomic<unsigned long> written{0};
+    size_t highWater = 0;
+
+  private:
+    // (with bufferLock held) queue the current buffer for writing, and start filling a spare one
+    void hand () {
+      this->full[(this->fullStart + this->fullCount) % BEATSTEP_CAPTURE_BUFFERS] = this->current;
+      this->fullCount++;
+      if (this->fullCount > this->highWater) {
+        this->highWater = this->fullCount;
+      }
+      this->current = this->spare[--this->spareCount];
+      this->bufferReady.notify_one();
+    }
+
+    // the writer thread: write full buffers as they come, and a partly-filled one now & then
+    void drain () {
+      std::unique_lock<std::mutex> lock(this->bufferLock);
+      while (true) {
+        if (!this->fullCount) {
+          if (!this->closing) {
+            this->bufferReady.wait_for(lock, std::chrono::milliseconds(BEATSTEP_CAPTURE_FLUSH_MS));
+          }
+          if (!this->fullCount && this->fills[this->current] && this->spareCount) {
+            this->hand();
+          }
+          if (!this->fullCount) {
+            if (this->closing) {
+              return;
+            }
+            continue;
+          }
+        }
+        size_t b = this->full[this->fullStart];
+        this->fullStart = (this->fullStart + 1) % BEATSTEP_CAPTURE_BUFFERS;
+        this->fullCount--;
+        lock.unlock();
+        fwrite(this->buffers[b], 1, this->fills[b], this->file);
+        fflush(this->file);
+        this->written += this->fills[b];
+        lock.lock();
+        this->fills[b] = 0;
+        this->spare[this->spareCount++] = b;
+      }
+    }
+
+    FILE *file;
+    clock::time_point started;
+    std::thread writer;
+
+    // buffers are either being filled (current), waiting to be written (full, oldest first), or spare
+    std::mutex bufferLock;
+    std::condition_variable bufferReady;
+    unsigned char *buffers[BEATSTEP_CAPTURE_BUFFERS];
+    size_t fills[BEATSTEP_CAPTURE_BUFFERS];
+    size_t current = 0;
+    size_t full[BEATSTEP_CAPTURE_BUFFERS];
+    size_t fullStart = 0;
+    size_t fullCount = 0;
+    size_t spare[BEATSTEP_CAPTURE_BUFFERS];
+    size_t spareCount = 0;
+    bool closing = false;
+};
+
+// read a capture, calling onRecord(time, direction, port, data, size) for each record (time is ns since it started)
+// returns its header; a record cut off at the end (from a crash) is left out
+template <typename F>
+BeatstepCaptureHeader beatstepReadCapture (std::string filename, F onRecord) {
+  std::ifstream i(filename, std::ios::binary);
+  if (!i) {
+    throw std::invalid_argument("Could not open: " + filename);
+  }
+  BeatstepCaptureHeader header;
+  if (!i.read((char *)&header, sizeof(header)) || memcmp(header.magic, BEATSTEP_CAPTURE_MAGIC, 4) != 0 || header.version != BEATSTEP_CAPTURE_VERSION) {
+    throw std::invalid_argument("Not a capture file: " + filename);
+  }
+  BeatstepCaptureRecord r;
+  std::vector<unsigned char> data(0xFFFF);
+  while (i.read((char *)&r, sizeof(r))) {
+    size_t size = beatstepGetLE(r.size, 2);
+    if (!i.read((char *)data.data(), size)) {
+      break;
+    }
+    onRecord(beatstepGetLE(r.time, 8), (BeatstepCaptureDirection)r.direction, r.port, (const unsigned char *)data.data(), size);
+  }
+  return header;
+}
+
+// what a message to or from a BeatStep means, if it's one we know
+inline std::string beatstepDescribe (const unsigned char *data, size_t size) {
+  std::ostringstream o;
+  bool arturia = size >= 11 && memcmp(data, BEATSTEP_ARTURIA_HEADER, sizeof(BEATSTEP_ARTURIA_HEADER)) == 0 && data[7] == 0x00;
+  if (arturia && size == 11 && data[6] == 0x01) {
+    o << "get " << (int)data[9] << ":" << (int)data[8];
+  } else if (arturia && size == 12 && data[6] == 0x02) {
+    o << "set " << (int)data[9] << ":" << (int)data[8] << " = " << (int)data[10];
+  } else if (size == 6 && data[0] == 0xF0 && data[1] == 0x7E && data[3] == 0x06 && data[4] == 0x01) {
+    o << "identity request";
+  } else if (beatstepMatches(BEATSTEP_IDENTITY_REPLY, data, size)) {
+    o << "identity " << (int)data[15] << "." << (int)data[14] << "." << (int)data[13] << "." << (int)data[12];
+  }
+  return o.str();
+}
@@ -0,0 +1,679 @@
+#pragma once
+
+// a pretend BeatStep on a virtual port: it keeps every param-value, takes writes, answers reads &
+// identity-requests like the real thing, and can keep its memory in a file between runs
+// so host-side code can be tried out (and timed) without hardware
+// a profile makes it act like a device on a bad day: replies that are late, jittery, lost or out of
+// order, and a device that falls behind after a burst (all from a seeded generator, so runs repeat)
+// any number of emulators can share one BeatstepEmulatorLoop, which sends every delayed reply from one thread
+// or it can replay a capture: each request gets exactly the replies the recorded device gave it, as late
+
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <random>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <memory>
+#include "BeatstepTransport.hpp"
+#include "BeatstepSysex.hpp"
+#include "BeatstepPreset.hpp"
+#include "BeatstepCapture.hpp"
+
+#define BEATSTEP_EMULATOR_MAGIC "BSEM"
+#define BEATSTEP_EMULATOR_VERSION 1
+
+// the firmware version an emulator reports, unless it's given one
+static constexpr unsigned char BEATSTEP_EMULATOR_FIRMWARE[4] = { 1, 0, 0, 0 };
+
+// an emulator's state file: a 16-byte header, then every param-value, indexed [pp][cc]
+struct BeatstepEmulatorState {
+  char magic[4];
+  unsigned char version;
+  unsigned char firmware[4];
+  unsigned char reserved[7];
+  unsigned char memory[0x80][0x80];
+};
+
+static_assert(sizeof(BeatstepEmulatorState) == 16 + 0x4000, "emulator state is a 16-byte header and the memory");
+
+// how reply delays are spread around the profile's latency
+enum BeatstepDelayShape {
+  BEATSTEP_DELAY_UNIFORM,     // latency +/- jitter
+  BEATSTEP_DELAY_NORMAL,      // jitter is the standard deviation
+  BEATSTEP_DELAY_EXPONENTIAL  // latency at least, with a long tail (jitter is the mean of the extra)
+};
+
+static const char *BEATSTEP_DELAY_SHAPE_NAMES[] = { "uniform", "normal", "exponential" };
+
+// how the emulator misbehaves (times are in ms, chances are 0-1)
+struct BeatstepEmulatorProfile {
+  std::string name;
+  double latency;            // before a reply goes out
+  double jitter;             // spread around that (see shape)
+  BeatstepDelayShape shape;
+  double drop;               // chance a reply never goes out
+  double reorder;            // chance a reply is held back by hold, so later ones overtake it
+  double hold;
+  double rate;               // messages per second it keeps up with once a burst is used up (0 is no limit)
+  double burst;
+  unsigned int seed;
+};
+
+static const BeatstepEmulatorProfile BEATSTEP_EMULATOR_PROFILES[] = {
+  { "ideal", 0, 0, BEATSTEP_DELAY_UNIFORM, 0, 0, 0, 0, 0, 1 },
+  { "usb", 0.5, 0.2, BEATSTEP_DELAY_NORMAL, 0, 0, 0, 0, 0, 1 },
+  { "hub", 1.5, 1.5, BEATSTEP_DELAY_EXPONENTIAL, 0.002, 0.01, 5, 2000, 64, 1 },
+  { "flaky", 3, 5, BEATSTEP_DELAY_EXPONENTIAL, 0.02, 0.05, 10, 500, 16, 1 }
+};
+
+// a named profile, then any settings to change: "hub,drop=0.05,seed=7" (or just settings, on top of ideal)
+inline BeatstepEmulatorProfile beatstepParseProfile (std::string text) {
+  BeatstepEmulatorProfile profile = BEATSTEP_EMULATOR_PROFILES[0];
+  size_t at = 0;
+  bool first = true;
+  while (at <= text.size()) {
+    size_t end = text.find(',', at);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    std::string item = text.substr(at, end - at);
+    at = end + 1;
+    if (item.empty()) {
+      continue;
+    }
+    size_t equals = item.find('=');
+    if (equals == std::string::npos) {
+      bool found = false;
+      for (const BeatstepEmulatorProfile &p : BEATSTEP_EMULATOR_PROFILES) {
+        if (first && p.name == item) {
+          profile = p;
+          found = true;
+        }
+      }
+      if (!found) {
+        throw std::invalid_argument("Unknown profile: " + item);
+      }
+      first = false;
+      continue;
+    }
+    first = false;
+    std::string key = item.substr(0, equals);
+    std::string value = item.substr(equals + 1);
+    double *field = key == "latency" ? &profile.latency
+      : key == "jitter" ? &profile.jitter
+      : key == "drop" ? &profile.drop
+      : key == "reorder" ? &profile.reorder
+      : key == "hold" ? &profile.hold
+      : key == "rate" ? &profile.rate
+      : key == "burst" ? &profile.burst
+      : nullptr;
+    bool ok = false;
+    if (key == "shape") {
+      for (int i = BEATSTEP_DELAY_UNIFORM; i <= BEATSTEP_DELAY_EXPONENTIAL; i++) {
+        if (value == BEATSTEP_DELAY_SHAPE_NAMES[i]) {
+          profile.shape = (BeatstepDelayShape)i;
+          ok = true;
+        }
+      }
+    } else if (key == "seed" || field) {
+      char *rest = nullptr;
+      double number = strtod(value.c_str(), &rest);
+      ok = !value.empty() && *rest == 0 && number >= 0;
+      if (key == "seed") {
+        profile.seed = number;
+      } else {
+        *field = number;
+      }
+    } else {
+      throw std::invalid_argument("Unknown profile setting: " + key);
+    }
+    if (!ok) {
+      throw std::invalid_argument("Bad profile setting: " + item);
+    }
+  }
+  return profile;
+}
+
+// "1.0.4.2" as 4 bytes, in the order version() gives them back
+inline void beatstepParseFirmware (std::string text, unsigned char *firmware) {
+  unsigned int parts[4];
+  char extra;
+  if (sscanf(text.c_str(), "%u.%u.%u.%u%c", &parts[0], &parts[1], &parts[2], &parts[3], &extra) != 4) {
+    throw std::invalid_argument("Not a firmware version: " + text);
+  }
+  for (int i = 0; i < 4; i++) {
+    if (parts[i] > 0x7F) {
+      throw std::invalid_argument("Not a firmware version: " + text);
+    }
+    firmware[i] = parts[i];
+  }
+}
+
+// a reply waiting for its time to go out, and who sends it
+struct BeatstepEmulatorReply {
+  typedef void (*Sender) (void *target, const unsigned char *bytes, size_t size);
+
+  std::chrono::steady_clock::time_point due;
+  unsigned long order;  // so replies due at the same time go out in the order they were made
+  Sender sender;
+  void *target;
+  size_t size;
+  unsigned char bytes[BEATSTEP_PARSER_MAX];
+
+  // (for a heap with the soonest on top)
+  bool operator< (const BeatstepEmulatorReply &other) const {
+    return this->due != other.due ? this->due > other.due : this->order > other.order;
+  }
+};
+
+// sends delayed replies when they're due, for as many emulators as are sharing it
+class BeatstepEmulatorLoop {
+  public:
+    typedef std::chrono::steady_clock clock;
+
+    ~BeatstepEmulatorLoop () {
+      this->stop();
+    }
+
+    void start () {
+      if (!this->thread.joinable()) {
+        this->stopping = false;
+        this->thread = std::thread(&BeatstepEmulatorLoop::run, this);
+      }
+    }
+
+    // stop sending (replies still waiting are dropped)
+    void stop () {
+      if (this->thread.joinable()) {
+        {
+          std::lock_guard<std::mutex> lock(this->queueLock);
+          this->stopping = true;
+        }
+        this->queueReady.notify_one();
+        this->thread.join();
+      }
+      this->queue.clear();
+    }
+
+    void post (BeatstepEmulatorReply &reply) {
+      {
+        std::lock_guard<std::mutex> lock(this->queueLock);
+        reply.order = this->order++;
+        this->queue.push_back(reply);
+        std::push_heap(this->queue.begin(), this->queue.end());
+      }
+      this->queueReady.notify_one();
+    }
+
+    // drop everything waiting for target, and wait until none of its replies is being sent
+    void forget (void *target) {
+      std::unique_lock<std::mutex> lock(this->queueLock);
+      this->queue.erase(std::remove_if(this->queue.begin(), this->queue.end(), [target] (const BeatstepEmulatorReply &r) {
+        return r.target == target;
+      }), this->queue.end());
+      std::make_heap(this->queue.begin(), this->queue.end());
+      this->sent.wait(lock, [this, target] {
+        return this->sending != target;
+      });
+    }
+
+  private:
+    void run () {
+      std::unique_lock<std::mutex> lock(this->queueLock);
+      while (!this->stopping) {
+        if (this->queue.empty()) {
+          this->queueReady.wait(lock);
+          continue;
+        }
+        if (clock::now() < this->queue.front().due) {
+          this->queueReady.wait_until(lock, this->queue.front().due);
+          continue;
+        }
+        std::pop_heap(this->queue.begin(), this->queue.end());
+        BeatstepEmulatorReply r = this->queue.back();
+        this->queue.pop_back();
+        this->sending = r.target;
+        lock.unlock();
+        r.sender(r.target, r.bytes, r.size);
+        lock.lock();
+        this->sending = nullptr;
+        this->sent.notify_all();
+      }
+    }
+
+    std::thread thread;
+    std::mutex queueLock;
+    std::condition_variable queueReady;
+    std::condition_variable sent;
+    std::vector<BeatstepEmulatorReply> queue;  // a heap
+    unsigned long order = 0;
+    void *sending = nullptr;
+    bool stopping = false;
+};
+
+// one reply a recorded device gave, and how long after the request (in ns)
+struct BeatstepReplayReply {
+  uint64_t delay;
+  std::vector<unsigned char> bytes;
+};
+
+// a capture, turned into what to say back to each request, in the order the requests were made
+// replies are matched to the request they answer (by address for param-reads), so pipelined reads replay right
+class BeatstepReplay {
+  public:
+    // port picks one device out of a capture of several
+    BeatstepReplay (std::string filename, unsigned char port = 0) {
+      struct Message {
+        uint64_t time;
+        BeatstepCaptureDirection direction;
+        std::vector<unsigned char> bytes;
+      };
+      std::vector<Message> messages;
+      BeatstepParser parsers[2];
+      BeatstepCaptureHeader header = beatstepReadCapture(filename, [&messages, &parsers, port] (uint64_t time, BeatstepCaptureDirection direction, unsigned char p, const unsigned char *data, size_t size) {
+        if (p != port || direction > BEATSTEP_CAPTURE_OUT) {
+          return;
+        }
+        parsers[direction].feed(data, size, [&messages, time, direction] (const unsigned char *frame, size_t n) {
+          messages.push_back({ time, direction, std::vector<unsigned char>(frame, frame + n) });
+        });
+      });
+      BeatstepCaptureDirection toDevice = header.flags & BEATSTEP_CAPTURE_HOST ? BEATSTEP_CAPTURE_OUT : BEATSTEP_CAPTURE_IN;
+
+      std::unordered_map<int, std::deque<size_t>> unansweredReads;
+      std::deque<size_t> unansweredIdentities;
+      long latest = -1;
+      for (const Message &m : messages) {
+        const unsigned char *b = m.bytes.data();
+        size_t n = m.bytes.size();
+        bool arturia = n >= 11 && memcmp(b, BEATSTEP_ARTURIA_HEADER, sizeof(BEATSTEP_ARTURIA_HEADER)) == 0 && b[7] == 0x00;
+        if (m.direction == toDevice) {
+          // writes aren't answered, so the emulator just remembers them
+          if (arturia && n == 12 && b[6] == 0x02) {
+            continue;
+          }
+          this->exchanges.push_back({ m.time, {} });
+          latest = this->exchanges.size() - 1;
+          this->waiting[std::string((const char *)b, n)].push_back(latest);
+          if (arturia && n == 11 && b[6] == 0x01) {
+            unansweredReads[(b[8] << 8) | b[9]].push_back(latest);
+          } else if (n == 6 && b[1] == 0x7E && b[3] == 0x06 && b[4] == 0x01) {
+            unansweredIdentities.push_back(latest);
+          }
+          this->requests++;
+          continue;
+        }
+
+        // a reply goes with the oldest request it answers, and anything else with the latest request
+        long to = latest;
+        if (beatstepMatches(BEATSTEP_PARAM_REPLY, b, n)) {
+          std::deque<size_t> &reads = unansweredReads[(b[8] << 8) | b[9]];
+          if (!reads.empty()) {
+            to = reads.front();
+            reads.pop_front();
+          }
+        } else if (beatstepMatches(BEATSTEP_IDENTITY_REPLY, b, n) && !unansweredIdentities.empty()) {
+          to = unansweredIdentities.front();
+          unansweredIdentities.pop_front();
+        }
+        if (to < 0) {
+          continue;
+        }
+        this->exchanges[to].replies.push_back({ m.time - this->exchanges[to].time, m.bytes });
+        this->replies++;
+      }
+    }
+
+    // the replies recorded for the next time this request was made, or nullptr if it wasn't made again
+    // (an empty list means the device never answered it)
+    const std::vector<BeatstepReplayReply> *next (const unsigned char *request, size_t size) {
+      auto found = this->waiting.find(std::string((const char *)request, size));
+      if (found == this->waiting.end() || found->second.empty()) {
+        return nullptr;
+      }
+      size_t exchange = found->second.front();
+      found->second.pop_front();
+      return &this->exchanges[exchange].replies;
+    }
+
+    // how many requests & replies the capture had for this device
+    unsigned long requests = 0;
+    unsigned long replies = 0;
+
+  private:
+    struct Exchange {
+      uint64_t time;
+      std::vector<BeatstepReplayReply> replies;
+    };
+
+    std::vector<Exchange> exchanges;
+    std::unordered_map<std::string, std::deque<size_t>> waiting;
+};
+
+class BeatstepEmulator {
+  public:
+    typedef std::chrono::steady_clock clock;
+
+    // the emulator owns the transport, and keeps its memory in stateFile (if there is one)
+    BeatstepEmulator (BeatstepTransport *transport, std::string stateFile = "") {
+      this->transport = transport;
+      this->stateFile = stateFile;
+      this->reset();
+    }
+
+    ~BeatstepEmulator () {
+      this->stop();
+    }
+
+    // send delayed replies from a loop that's shared with other emulators, instead of one of its own (set before start)
+    // the loop has to outlive the emulator
+    void setLoop (BeatstepEmulatorLoop *loop) {
+      this->loop = loop;
+    }
+
+    // answer requests as the device in a capture did, with its timing divided by speed (0 is no waiting)
+    // requests the capture doesn't have (or has fewer of) are answered as usual (set before start)
+    void setReplay (BeatstepReplay *replay, double speed = 1) {
+      this->replay = replay;
+      this->speed = speed;
+    }
+
+    // misbehave like this (set before start)
+    void setProfile (const BeatstepEmulatorProfile &profile) {
+      this->profile = profile;
+      this->random.seed(profile.seed);
+      this->tokens = profile.burst;
+    }
+
+    // forget every value (and go back to the default firmware)
+    void reset () {
+      memset(&this->state, 0, sizeof(this->state));
+      memcpy(this->state.magic, BEATSTEP_EMULATOR_MAGIC, 4);
+      this->state.version = BEATSTEP_EMULATOR_VERSION;
+      memcpy(this->state.firmware, BEATSTEP_EMULATOR_FIRMWARE, 4);
+    }
+
+    void setFirmware (const unsigned char *firmware) {
+      memcpy(this->state.firmware, firmware, 4);
+    }
+
+    // pick up the memory from the state file, if there is one
+    bool loadState () {
+      if (this->stateFile.empty()) {
+        return false;
+      }
+      std::ifstream i(this->stateFile, std::ios::binary);
+      if (!i) {
+        return false;
+      }
+      BeatstepEmulatorState loaded;
+      if (!i.read((char *)&loaded, sizeof(loaded)) || memcmp(loaded.magic, BEATSTEP_EMULATOR_MAGIC, 4) != 0 || loaded.version != BEATSTEP_EMULATOR_VERSION) {
+        throw std::invalid_argument("Not an emulator state file: " + this->stateFile);
+      }
+      this->state = loaded;
+      return true;
+    }
+
+    // write the memory to the state file (to a temporary file first, like presets)
+    void saveState () {
+      if (this->stateFile.empty()) {
+        return;
+      }
+      std::string temporary = this->stateFile + ".tmp";
+      {
+        std::ofstream o(temporary, std::ios::binary);
+        o.write((const char *)&this->state, sizeof(this->state));
+        if (!o) {
+          std::remove(temporary.c_str());
+          throw std::invalid_argument("Could not write: " + this->stateFile);
+        }
+      }
+      beatstepReplaceFile(temporary, this->stateFile);
+    }
+
+    // make the virtual port, and start answering whatever comes in on it
+    // replies go out straight from the transport's thread, unless the profile delays them
+    void start (std::string name) {
+      const BeatstepEmulatorProfile &p = this->profile;
+      this->delayed = p.latency > 0 || p.jitter > 0 || p.reorder > 0 || p.rate > 0 || this->replay;
+      if (this->delayed && !this->loop) {
+        this->ownLoop.reset(new BeatstepEmulatorLoop());
+        this->loop = this->ownLoop.get();
+      }
+      if (this->delayed) {
+        this->loop->start();
+      }
+      this->last = clock::now();
+      this->transport->setReceiver(&BeatstepEmulator::receive, this);
+      this->transport->openVirtualPort(name);
+    }
+
+    // close the port (nothing is handled after this returns, and replies still waiting are dropped)
+    void stop () {
+      if (!this->transport) {
+        return;
+      }
+      // in this order: a request still being handled could post a reply, and a reply could still be going out
+      this->transport->stopInput();
+      if (this->ownLoop) {
+        this->ownLoop->stop();
+      } else if (this->loop) {
+        this->loop->forget(this);
+      }
+      delete this->transport;
+      this->transport = nullptr;
+    }
+
+    unsigned char get (unsigned char cc, unsigned char pp) const {
+      return this->state.memory[pp & 0x7F][cc & 0x7F];
+    }
+
+    void set (unsigned char cc, unsigned char pp, unsigned char vv) {
+      this->state.memory[pp & 0x7F][cc & 0x7F] = vv & 0x7F;
+    }
+
+    // record everything that comes in & goes out (set before start)
+    // port tells this emulator's messages apart from others in the same capture
+    void setCapture (BeatstepCaptureWriter *capture, unsigned char port = 0) {
+      this->capture = capture;
+      this->port = port;
+    }
+
+    // what's been handled so far
+    std::atomic<unsigned long> reads{0};
+    std::atomic<unsigned long> writes{0};
+    std::atomic<unsigned long> identities{0};
+    std::atomic<unsigned long> ignored{0};
+
+    // what the profile did
+    std::atomic<unsigned long> dropped{0};
+    std::atomic<unsigned long> reordered{0};
+    std::atomic<unsigned long> limited{0};  // messages that came in after a burst had used up the rate
+
+    // with a replay: requests answered from the capture, and ones it didn't have
+    std::atomic<unsigned long> replayed{0};
+    std::atomic<unsigned long> unscripted{0};
+
+    BeatstepEmulatorState state;
+    BeatstepEmulatorProfile profile = BEATSTEP_EMULATOR_PROFILES[0];
+
+  private:
+    static void receive (double, const unsigned char *data, size_t size, void *userData) {
+      BeatstepEmulator *self = (BeatstepEmulator *)userData;
+      if (self->capture) {
+        self->capture->record(BEATSTEP_CAPTURE_IN, data, size, self->port);
+      }
+      self->parser.feed(data, size, [self] (const unsigned char *message, size_t n) {
+        self->handle(message, n);
+      });
+    }
+
+    // answer one complete sysex message
+    void handle (const unsigned char *message, size_t size) {
+      this->busy();
+      bool arturia = size >= 11 && memcmp(message, BEATSTEP_ARTURIA_HEADER, sizeof(BEATSTEP_ARTURIA_HEADER)) == 0 && message[7] == 0x00;
+
+      if (this->replay && !(arturia && size == 12 && message[6] == 0x02)) {
+        const std::vector<BeatstepReplayReply> *replies = this->replay->next(message, size);
+        if (replies) {
+          this->replayed++;
+          for (const BeatstepReplayReply &r : *replies) {
+            double delay = this->speed > 0 ? r.delay / this->speed : 0;
+            this->schedule(r.bytes.data(), r.bytes.size(), this->ready + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::nano>(delay)));
+          }
+          return;
+        }
+        this->unscripted++;
+      }
+
+      // F0 00 20 6B 7F 42 01 00 pp cc F7
+      if (arturia && size == 11 && message[6] == 0x01) {
+        this->reads++;
+        BeatstepFrame<12> reply = beatstepSetFrame(message[9], message[8], this->get(message[9], message[8]));
+        this->reply(reply.data(), reply.size());
+        return;
+      }
+
+      // F0 00 20 6B 7F 42 02 00 pp cc vv F7
+      if (arturia && size == 12 && message[6] == 0x02) {
+        this->writes++;
+        this->set(message[9], message[8], message[10]);
+        return;
+      }
+
+      // F0 7E <any device> 06 01 F7
+      if (size == 6 && message[1] == 0x7E && message[3] == 0x06 && message[4] == 0x01) {
+        this->identities++;
+        unsigned char reply[17];
+        memcpy(reply, BEATSTEP_IDENTITY_REPLY.value, 12);
+        for (int i = 0; i < 4; i++) {
+          reply[15 - i] = this->state.firmware[i];
+        }
+        reply[16] = 0xF7;
+        this->reply(reply, sizeof(reply));
+        return;
+      }
+
+      this->ignored++;
+    }
+
+    // a message came in: with a rate-limit, the device is done with it once it's worked through the ones before it
+    void busy () {
+      clock::time_point now = clock::now();
+      this->ready = now;
+      if (this->profile.rate <= 0) {
+        return;
+      }
+      std::chrono::duration<double> elapsed = now - this->last;
+      this->last = now;
+      this->tokens = std::min(this->profile.burst, this->tokens + elapsed.count() * this->profile.rate);
+      this->tokens -= 1;
+      if (this->tokens < 0) {
+        this->limited++;
+        this->ready = now + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(-this->tokens / this->profile.rate));
+      }
+    }
+
+    double chance () {
+      return std::uniform_real_distribution<double>(0, 1)(this->random);
+    }
+
+    // how long a reply takes to go out, in ms
+    double delay () {
+      const BeatstepEmulatorProfile &p = this->profile;
+      double d = p.latency;
+      if (p.jitter > 0) {
+        if (p.shape == BEATSTEP_DELAY_UNIFORM) {
+          d += p.jitter * (2 * this->chance() - 1);
+        } else if (p.shape == BEATSTEP_DELAY_NORMAL) {
+          d += std::normal_distribution<double>(0, p.jitter)(this->random);
+        } else {
+          d -= p.jitter * std::log(1 - this->chance());
+        }
+      }
+      return d < 0 ? 0 : d;
+    }
+
+    // send a reply (or lose it, or hold it back for the loop), as the profile says
+    void reply (const unsigned char *bytes, size_t size) {
+      const BeatstepEmulatorProfile &p = this->profile;
+      if (p.drop > 0 && this->chance() < p.drop) {
+        this->dropped++;
+        return;
+      }
+      if (!this->delayed) {
+        this->transmit(bytes, size);
+        return;
+      }
+
+      clock::time_point due = this->ready + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(this->delay()));
+      if (p.reorder > 0 && this->chance() < p.reorder) {
+        this->reordered++;
+        due += std::chrono::duration_cast<clock::duration>(std::chrono::duration<double, std::milli>(p.hold));
+      } else {
+        // jitter alone never puts replies out of order (USB doesn't)
+        if (due < this->lastDue) {
+          due = this->lastDue;
+        }
+        this->lastDue = due;
+      }
+      this->schedule(bytes, size, due);
+    }
+
+    // have the loop send a reply at due
+    void schedule (const unsigned char *bytes, size_t size, clock::time_point due) {
+      if (size > BEATSTEP_PARSER_MAX) {
+        return;
+      }
+      BeatstepEmulatorReply r;
+      r.due = due;
+      r.sender = &BeatstepEmulator::transmitTo;
+      r.target = this;
+      r.size = size;
+      memcpy(r.bytes, bytes, size);
+      this->loop->post(r);
+    }
+
+    void transmit (const unsigned char *bytes, size_t size) {
+      if (this->capture) {
+        this->capture->record(BEATSTEP_CAPTURE_OUT, bytes, size, this->port);
+      }
+      this->transport->send(bytes, size);
+    }
+
+    static void transmitTo (void *target, const unsigned char *bytes, size_t size) {
+      ((BeatstepEmulator *)target)->transmit(bytes, size);
+    }
+
+    BeatstepTransport *transport;
+    std::string stateFile;
+    BeatstepParser parser;
+    BeatstepCaptureWriter *capture = nullptr;
+    unsigned char port = 0;
+
+    // the profile's state (only touched on the transport's thread)
+    std::mt19937 random{1};
+    double tokens = 0;
+    clock::time_point last;
+    clock::time_point ready;
+    clock::time_point lastDue;
+
+    BeatstepReplay *replay = nullptr;
+    double speed = 1;
+
+    bool delayed = false;
+    BeatstepEmulatorLoop *loop = nullptr;
+    std::unique_ptr<BeatstepEmulatorLoop> ownLoop;
+};
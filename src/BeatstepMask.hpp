@@ -0,0 +1,124 @@
+#pragma once
+
+// picking out some of the preset params, so save/load only touch those
+// a mask is made of comma (or line) separated items, each one of:
+//   a group:  knobs, transport, pads, globals (or all)
+//   a key:    112_3, global_1_80
+//   a range:  CC[-CC][:PP[-PP]], in decimal or 0x-hex, like 0x70-0x7F (all of the pads) or 0x70-0x7F:3
+//             (just their notes)
+
+#include <bitset>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include "BeatstepParams.hpp"
+
+// one bit per param, in BEATSTEP_PARAMS order
+typedef std::bitset<BEATSTEP_PARAM_COUNT> BeatstepMask;
+
+static const BeatstepMask BEATSTEP_MASK_ALL = BeatstepMask().set();
+
+// every param with cc and pp inside these (inclusive) ranges
+inline BeatstepMask beatstepMaskRange (unsigned int ccFirst, unsigned int ccLast, unsigned int ppFirst, unsigned int ppLast) {
+  BeatstepMask mask;
+  for (size_t i = 0; i < BEATSTEP_PARAMS.size(); i++) {
+    const BeatstepParam &p = BEATSTEP_PARAMS[i];
+    if (p.cc >= ccFirst && p.cc <= ccLast && p.pp >= ppFirst && p.pp <= ppLast) {
+      mask.set(i);
+    }
+  }
+  return mask;
+}
+
+// "N" or "N-M" (each decimal or 0x-hex)
+inline void beatstepParseMaskRange (std::string text, unsigned int &first, unsigned int &last) {
+  size_t dash = text.find('-');
+  size_t used = 0;
+  first = std::stoul(text.substr(0, dash), &used, 0);
+  if (used != text.substr(0, dash).size()) {
+    throw std::invalid_argument("Bad number: " + text);
+  }
+  last = first;
+  if (dash != std::string::npos) {
+    last = std::stoul(text.substr(dash + 1), &used, 0);
+    if (used != text.size() - dash - 1) {
+      throw std::invalid_argument("Bad number: " + text);
+    }
+  }
+}
+
+// one item of a mask (see above)
+inline BeatstepMask beatstepMaskItem (std::string item) {
+  if (item == "all") {
+    return BEATSTEP_MASK_ALL;
+  }
+  if (item == "globals") {
+    return beatstepMaskRange(0x00, 0x1F, 0x00, 0x7F);
+  }
+  for (const BeatstepParamBlock &block : BEATSTEP_PARAM_BLOCKS) {
+    if (item == block.name) {
+      return beatstepMaskRange(block.ccFirst, block.ccLast, block.ppFirst, block.ppLast);
+    }
+  }
+
+  BeatstepMask mask;
+  int i = BEATSTEP_PARAMS.find(item.data(), item.size());
+  if (i >= 0) {
+    mask.set(i);
+    return mask;
+  }
+
+  unsigned int ccFirst, ccLast;
+  unsigned int ppFirst = 0x00;
+  unsigned int ppLast = 0x7F;
+  size_t colon = item.find(':');
+  try {
+    beatstepParseMaskRange(item.substr(0, colon), ccFirst, ccLast);
+    if (colon != std::string::npos) {
+      beatstepParseMaskRange(item.substr(colon + 1), ppFirst, ppLast);
+    }
+  } catch (std::logic_error &) {
+    throw std::invalid_argument("Unknown params: " + item);
+  }
+  mask = beatstepMaskRange(ccFirst, ccLast, ppFirst, ppLast);
+  if (mask.none()) {
+    throw std::invalid_argument("No preset params in: " + item);
+  }
+  return mask;
+}
+
+// all the items in a list (split on commas, newlines & spaces, with # starting a comment)
+inline BeatstepMask beatstepParseMask (std::string text) {
+  BeatstepMask mask;
+  std::string item;
+  bool comment = false;
+  for (size_t i = 0; i <= text.size(); i++) {
+    char c = i < text.size() ? text[i] : '\n';
+    if (c == '#') {
+      comment = true;
+    }
+    if (c == ',' || c == '\n' || c == '\r' || c == ' ' || c == '\t' || c == '#') {
+      if (!item.empty()) {
+        mask |= beatstepMaskItem(item);
+        item.clear();
+      }
+      if (c == '\n') {
+        comment = false;
+      }
+    } else if (!comment) {
+      item += c;
+    }
+  }
+  return mask;
+}
+
+// a mask file: items one per line (or comma-separated), with # comments
+inline BeatstepMask beatstepReadMask (std::string filename) {
+  std::ifstream i(filename);
+  if (!i) {
+    throw std::invalid_argument("Could not open: " + filename);
+  }
+  std::string text((std::istreambuf_iterator<char>(i)), std::istreambuf_iterator<char>());
+  return beatstepParseMask(text);
+}
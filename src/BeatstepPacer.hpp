@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+#include <thread>
+
+// slowest the pacer will ever go, in writes per second
+#define BEATSTEP_PACER_MIN_RATE 10
+
+// learned rates allow a burst of this fraction of a second's writes (250 = 4ms)
+#define BEATSTEP_PACER_BURST_RATIO 250
+
+// token-bucket that spaces out writes, so the device is never sent more than it can take
+class BeatstepPacer {
+  public:
+    typedef std::chrono::steady_clock clock;
+
+    // rate is in writes per second, burst is how many writes can go back-to-back
+    BeatstepPacer (double rate = 1000, double burst = 1) {
+      this->setRate(rate, burst);
+    }
+
+    void setRate (double rate, double burst = 1) {
+      this->rate = rate < BEATSTEP_PACER_MIN_RATE ? BEATSTEP_PACER_MIN_RATE : rate;
+      this->burst = burst < 1 ? 1 : burst;
+      this->tokens = this->burst;
+      this->last = clock::now();
+    }
+
+    // block until a write is allowed, and spend a token on it
+    void wait () {
+      this->refill();
+      if (this->tokens < 1) {
+        std::chrono::duration<double> gap((1 - this->tokens) / this->rate);
+        std::this_thread::sleep_for(gap);
+        this->refill();
+      }
+      this->tokens -= 1;
+    }
+
+    // block until at least one write is allowed, then spend every token that's there (up to max)
+    // returns how many writes can go out together
+    size_t take (size_t max) {
+      size_t n = 1;
+      this->wait();
+      while (n < max && this->tokens >= 1) {
+        this->tokens -= 1;
+        n++;
+      }
+      return n;
+    }
+
+    // the device dropped something: slow down a lot
+    void backoff () {
+      this->setRate(this->rate / 2, this->burst);
+    }
+
+    double rate;
+    double burst;
+
+  private:
+    void refill () {
+      clock::time_point now = clock::now();
+      this->tokens += std::chrono::duration<double>(now - this->last).count() * this->rate;
+      if (this->tokens > this->burst) {
+        this->tokens = this->burst;
+      }
+      this->last = now;
+    }
+
+    double tokens;
+    clock::time_point last;
+};
@@ -0,0 +1,203 @@
+#pragma once
+
+// every address that's saved in a preset, with its preset-file key
+// the whole table (keys included) is built at compile-time, so bulk operations never build strings
+
+#include <cstddef>
+
+// how many params a preset has, and the longest key ("global_15_83" and a nul)
+#define BEATSTEP_PARAM_COUNT 293
+#define BEATSTEP_PARAM_KEY_MAX 16
+
+// a single param-address on the device
+struct BeatstepAddress {
+  unsigned char cc;
+  unsigned char pp;
+};
+
+// the global settings that are saved with a preset
+static constexpr BeatstepAddress BEATSTEP_GLOBALS[] = {
+  {0x00, 0x52}, {0x00, 0x53},
+  {0x01, 0x50}, {0x01, 0x52}, {0x01, 0x53},
+  {0x02, 0x50}, {0x02, 0x52}, {0x02, 0x53},
+  {0x03, 0x41}, {0x03, 0x50}, {0x03, 0x52}, {0x03, 0x53},
+  {0x04, 0x41}, {0x04, 0x50}, {0x04, 0x52}, {0x04, 0x53},
+  {0x05, 0x50}, {0x05, 0x52}, {0x05, 0x53},
+  {0x06, 0x40}, {0x06, 0x50}, {0x06, 0x52}, {0x06, 0x53},
+  {0x07, 0x50}, {0x07, 0x52}, {0x07, 0x53},
+  {0x08, 0x50}, {0x08, 0x52}, {0x08, 0x53},
+  {0x09, 0x50}, {0x09, 0x52}, {0x09, 0x53},
+  {0x0A, 0x50}, {0x0A, 0x52}, {0x0A, 0x53},
+  {0x0B, 0x50}, {0x0B, 0x52}, {0x0B, 0x53},
+  {0x0C, 0x50}, {0x0C, 0x52}, {0x0C, 0x53},
+  {0x0D, 0x52}, {0x0D, 0x53},
+  {0x0E, 0x52}, {0x0E, 0x53},
+  {0x0F, 0x52}, {0x0F, 0x53}
+};
+
+// a run of controls that each have the same set of params (knobs, transport buttons, pads)
+struct BeatstepParamBlock {
+  const char *name;
+  unsigned char ccFirst;
+  unsigned char ccLast;
+  unsigned char ppFirst;
+  unsigned char ppLast;
+};
+
+static constexpr BeatstepParamBlock BEATSTEP_PARAM_BLOCKS[] = {
+  { "knobs", 0x20, 0x30, 0x01, 0x06 }, // (and volume)
+  { "transport", 0x58, 0x5F, 0x01, 0x06 },
+  { "pads", 0x70, 0x7F, 0x01, 0x06 }
+};
+
+// one param: where it is, and what it's called in a preset file
+// (what each can be set to isn't known per-param, so every value is just checked to be 7-bit, 0 to 0x7F)
+struct BeatstepParam {
+  unsigned char cc;
+  unsigned char pp;
+  unsigned char keySize;
+  char key[BEATSTEP_PARAM_KEY_MAX];
+};
+
+// for finding a param by address: the table is sorted by (pp << 8) | cc
+struct BeatstepParamIndexEntry {
+  unsigned short address;
+  unsigned short index;
+};
+
+struct BeatstepParamTable {
+  BeatstepParam params[BEATSTEP_PARAM_COUNT];
+  BeatstepParamIndexEntry index[BEATSTEP_PARAM_COUNT];
+
+  constexpr const BeatstepParam &operator[] (size_t i) const {
+    return this->params[i];
+  }
+
+  constexpr const BeatstepParam *begin () const {
+    return this->params;
+  }
+
+  constexpr const BeatstepParam *end () const {
+    return this->params + BEATSTEP_PARAM_COUNT;
+  }
+
+  static constexpr size_t size () {
+    return BEATSTEP_PARAM_COUNT;
+  }
+
+  // where cc:pp is in the table, or -1 if it isn't a preset param
+  constexpr int find (unsigned char cc, unsigned char pp) const {
+    unsigned short address = (pp << 8) | cc;
+    size_t low = 0;
+    size_t high = BEATSTEP_PARAM_COUNT;
+    while (low < high) {
+      size_t mid = (low + high) / 2;
+      if (this->index[mid].address < address) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    if (low < BEATSTEP_PARAM_COUNT && this->index[low].address == address) {
+      return this->index[low].index;
+    }
+    return -1;
+  }
+
+  // where the param with this preset-file key is in the table, or -1 if it isn't one
+  constexpr int find (const char *key, size_t size) const {
+    const char prefix[] = "global_";
+    size_t at = 0;
+    bool global = size > 7;
+    for (size_t i = 0; global && i < 7; i++) {
+      global = key[i] == prefix[i];
+    }
+    if (global) {
+      at = 7;
+    }
+    unsigned int numbers[2] = { 0, 0 };
+    for (int n = 0; n < 2; n++) {
+      size_t start = at;
+      while (at < size && key[at] >= '0' && key[at] <= '9' && at - start < 3) {
+        numbers[n] = numbers[n] * 10 + (key[at] - '0');
+        at++;
+      }
+      if (at == start || numbers[n] > 0x7F) {
+        return -1;
+      }
+      if (n == 0) {
+        if (at >= size || key[at] != '_') {
+          return -1;
+        }
+        at++;
+      }
+    }
+    if (at != size || global != (numbers[0] < 0x20)) {
+      return -1;
+    }
+    return this->find(numbers[0], numbers[1]);
+  }
+};
+
+constexpr size_t beatstepAppendNumber (char *out, size_t at, unsigned int value) {
+  char digits[4] = {};
+  size_t count = 0;
+  do {
+    digits[count++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  while (count) {
+    out[at++] = digits[--count];
+  }
+  return at;
+}
+
+// the key a param has in a preset file: "cc_pp", or "global_cc_pp" for globals
+constexpr BeatstepParam beatstepParam (unsigned char cc, unsigned char pp) {
+  BeatstepParam param = { cc, pp, 0, {} };
+  const char prefix[] = "global_";
+  size_t at = 0;
+  if (cc < 0x20) {
+    for (size_t i = 0; i < 7; i++) {
+      param.key[at++] = prefix[i];
+    }
+  }
+  at = beatstepAppendNumber(param.key, at, cc);
+  param.key[at++] = '_';
+  param.keySize = beatstepAppendNumber(param.key, at, pp);
+  return param;
+}
+
+constexpr BeatstepParamTable beatstepMakeParams () {
+  BeatstepParamTable table = {};
+  size_t count = 0;
+  for (const BeatstepParamBlock &block : BEATSTEP_PARAM_BLOCKS) {
+    for (unsigned int cc = block.ccFirst; cc <= block.ccLast; cc++) {
+      for (unsigned int pp = block.ppFirst; pp <= block.ppLast; pp++) {
+        table.params[count++] = beatstepParam(cc, pp);
+      }
+    }
+  }
+  for (const BeatstepAddress &a : BEATSTEP_GLOBALS) {
+    table.params[count++] = beatstepParam(a.cc, a.pp);
+  }
+
+  // insertion-sort the addresses for find()
+  for (size_t i = 0; i < BEATSTEP_PARAM_COUNT; i++) {
+    BeatstepParamIndexEntry entry = { (unsigned short)((table.params[i].pp << 8) | table.params[i].cc), (unsigned short)i };
+    size_t j = i;
+    while (j > 0 && table.index[j - 1].address > entry.address) {
+      table.index[j] = table.index[j - 1];
+      j--;
+    }
+    table.index[j] = entry;
+  }
+  return table;
+}
+
+static constexpr BeatstepParamTable BEATSTEP_PARAMS = beatstepMakeParams();
+
+static_assert(BEATSTEP_PARAMS[0].key[0] == '3' && BEATSTEP_PARAMS[0].key[1] == '2' && BEATSTEP_PARAMS[0].key[2] == '_', "first param is 32_1");
+static_assert(BEATSTEP_PARAMS.find(0x0F, 0x53) == BEATSTEP_PARAM_COUNT - 1, "last param is the last global");
+static_assert(BEATSTEP_PARAMS.find("global_15_83", 12) == BEATSTEP_PARAM_COUNT - 1, "keys map back to params");
+static_assert(BEATSTEP_PARAMS.find("15_83", 5) == -1, "globals need their prefix");
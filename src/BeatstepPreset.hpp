@@ -0,0 +1,345 @@
+#pragma once
+
+// presets in memory and on disk
+// the binary format is just a BeatstepPreset written out as-is: a 16-byte header, then one byte per
+// param in BEATSTEP_PARAMS order, so loading one is a single read (or mmap) with nothing to parse
+// JSON, MessagePack & CBOR files all hold the same key/value object (see beatstepPresetToJson), and are
+// read with a SAX parser that puts each value straight into the preset as it goes by (no DOM is built)
+
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <vector>
+#include <iterator>
+#include <cmath>
+#include <cstdio>
+#include <json.hpp>
+#include "BeatstepParams.hpp"
+
+#if defined(WIN32)
+  #include <windows.h>
+#endif
+
+#define BEATSTEP_PRESET_MAGIC "BSTP"
+#define BEATSTEP_PRESET_VERSION 1
+
+// value for a param the preset doesn't set (real values are 7-bit)
+#define BEATSTEP_PRESET_UNSET 0xFF
+
+enum BeatstepPresetFormat {
+  BEATSTEP_PRESET_AUTO = -1, // from the magic-bytes when reading, or the filename when writing
+  BEATSTEP_PRESET_JSON,
+  BEATSTEP_PRESET_BINARY,
+  BEATSTEP_PRESET_MSGPACK,
+  BEATSTEP_PRESET_CBOR
+};
+
+static const char *BEATSTEP_PRESET_FORMAT_NAMES[] = { "json", "binary", "msgpack", "cbor" };
+
+struct BeatstepPresetHeader {
+  char magic[4];              // BEATSTEP_PRESET_MAGIC
+  unsigned char version;      // BEATSTEP_PRESET_VERSION
+  unsigned char flags;        // unused, 0
+  unsigned char count[2];     // how many values follow (little-endian)
+  unsigned char firmware[4];  // version of the device it was saved from (0.0.0.0 if not known)
+  unsigned char reserved[4];
+};
+
+struct BeatstepPreset {
+  BeatstepPresetHeader header;
+  unsigned char values[BEATSTEP_PARAM_COUNT];
+};
+
+static_assert(sizeof(BeatstepPresetHeader) == 16, "preset header is 16 bytes");
+static_assert(sizeof(BeatstepPreset) == 16 + BEATSTEP_PARAM_COUNT, "preset has no padding");
+
+// a preset with nothing set
+inline BeatstepPreset beatstepEmptyPreset () {
+  BeatstepPreset preset;
+  memset(&preset, 0, sizeof(preset));
+  memcpy(preset.header.magic, BEATSTEP_PRESET_MAGIC, 4);
+  preset.header.version = BEATSTEP_PRESET_VERSION;
+  preset.header.count[0] = BEATSTEP_PARAM_COUNT & 0xFF;
+  preset.header.count[1] = BEATSTEP_PARAM_COUNT >> 8;
+  memset(preset.values, BEATSTEP_PRESET_UNSET, sizeof(preset.values));
+  return preset;
+}
+
+// the format with this name (as used on the command-line)
+inline BeatstepPresetFormat beatstepPresetFormatNamed (std::string name) {
+  for (int f = BEATSTEP_PRESET_JSON; f <= BEATSTEP_PRESET_CBOR; f++) {
+    if (name == BEATSTEP_PRESET_FORMAT_NAMES[f]) {
+      return (BeatstepPresetFormat)f;
+    }
+  }
+  throw std::invalid_argument("Unknown preset format: " + name);
+}
+
+// pick a format from the filename, for writing (.bsp, .msgpack & .cbor, or JSON for anything else)
+inline BeatstepPresetFormat beatstepPresetFormatFor (std::string filename) {
+  size_t dot = filename.rfind('.');
+  std::string extension = dot == std::string::npos ? "" : filename.substr(dot);
+  if (extension == ".bsp") {
+    return BEATSTEP_PRESET_BINARY;
+  }
+  if (extension == ".msgpack") {
+    return BEATSTEP_PRESET_MSGPACK;
+  }
+  if (extension == ".cbor") {
+    return BEATSTEP_PRESET_CBOR;
+  }
+  return BEATSTEP_PRESET_JSON;
+}
+
+// figure out an encoded preset's format from its first bytes
+inline BeatstepPresetFormat beatstepDetectPresetFormat (const unsigned char *data, size_t size) {
+  if (size >= 4 && memcmp(data, BEATSTEP_PRESET_MAGIC, 4) == 0) {
+    return BEATSTEP_PRESET_BINARY;
+  }
+  if (size) {
+    // a map: fixmap, map16 or map32 in MessagePack
+    if ((data[0] & 0xF0) == 0x80 || data[0] == 0xDE || data[0] == 0xDF) {
+      return BEATSTEP_PRESET_MSGPACK;
+    }
+    // a map (any length), or the self-describe tag (D9 D9 F7) in CBOR
+    if ((data[0] >= 0xA0 && data[0] <= 0xBB) || data[0] == 0xBF || data[0] == 0xD9) {
+      return BEATSTEP_PRESET_CBOR;
+    }
+  }
+  return BEATSTEP_PRESET_JSON;
+}
+
+// SAX handler that fills in a preset from the top-level keys of a JSON/MessagePack/CBOR object
+// keys are looked up in BEATSTEP_PARAMS as they arrive, unknown ones (and anything nested) are skipped,
+// and values are checked on the spot
+class BeatstepPresetReader : public nlohmann::json_sax<nlohmann::json> {
+  public:
+    BeatstepPresetReader () {
+      this->preset = beatstepEmptyPreset();
+    }
+
+    bool null () override {
+      return this->other();
+    }
+
+    bool boolean (bool) override {
+      return this->other();
+    }
+
+    bool number_integer (number_integer_t value) override {
+      return this->number(value);
+    }
+
+    bool number_unsigned (number_unsigned_t value) override {
+      return this->number(value > 0xFF ? 0xFF : (long long)value);
+    }
+
+    bool number_float (number_float_t value, const string_t &) override {
+      if (value != std::floor(value)) {
+        return this->other();
+      }
+      return this->number(value < -1 ? -1 : value > 0xFF ? 0xFF : (long long)value);
+    }
+
+    bool string (string_t &) override {
+      return this->other();
+    }
+
+    bool binary (binary_t &) override {
+      return this->other();
+    }
+
+    bool start_object (std::size_t) override {
+      if (this->depth > 0) {
+        this->other();
+      }
+      this->depth++;
+      return true;
+    }
+
+    bool key (string_t &key) override {
+      this->param = this->depth == 1 ? BEATSTEP_PARAMS.find(key.data(), key.size()) : -1;
+      return true;
+    }
+
+    bool end_object () override {
+      this->depth--;
+      return true;
+    }
+
+    bool start_array (std::size_t) override {
+      this->other();
+      this->depth++;
+      return true;
+    }
+
+    bool end_array () override {
+      this->depth--;
+      return true;
+    }
+
+    bool parse_error (std::size_t, const std::string &, const nlohmann::detail::exception &error) override {
+      throw std::invalid_argument(std::string("Bad preset: ") + error.what());
+    }
+
+    BeatstepPreset preset;
+
+  private:
+    bool number (long long value) {
+      if (this->depth == 0) {
+        throw std::invalid_argument("Not a preset");
+      }
+      if (this->param >= 0 && this->depth == 1) {
+        const BeatstepParam &p = BEATSTEP_PARAMS[this->param];
+        if (value < 0 || value > 0x7F) {
+          throw std::invalid_argument("Out of range: " + std::string(p.key) + " = " + std::to_string(value));
+        }
+        this->preset.values[this->param] = value;
+      }
+      this->param = -1;
+      return true;
+    }
+
+    // anything that isn't a number is fine, unless it's the value of a param (or the whole file)
+    bool other () {
+      if (this->depth == 0) {
+        throw std::invalid_argument("Not a preset");
+      }
+      if (this->param >= 0 && this->depth == 1) {
+        throw std::invalid_argument("Not a number: " + std::string(BEATSTEP_PARAMS[this->param].key));
+      }
+      this->param = -1;
+      return true;
+    }
+
+    int param = -1;
+    int depth = 0;
+};
+
+// keys are unique by construction, so they're appended straight on, without ordered_json checking each one
+inline nlohmann::ordered_json beatstepPresetToJson (const BeatstepPreset &preset) {
+  nlohmann::ordered_json j = {
+    { "device", "BeatStep" }
+  };
+  nlohmann::ordered_json::object_t &o = j.get_ref<nlohmann::ordered_json::object_t &>();
+  o.reserve(BEATSTEP_PARAMS.size() + 1);
+  for (size_t i = 0; i < BEATSTEP_PARAMS.size(); i++) {
+    if (preset.values[i] != BEATSTEP_PRESET_UNSET) {
+      o.emplace_back(std::string(BEATSTEP_PARAMS[i].key, BEATSTEP_PARAMS[i].keySize), preset.values[i]);
+    }
+  }
+  return j;
+}
+
+// turn a preset into the bytes of a file
+inline std::vector<unsigned char> beatstepEncodePreset (const BeatstepPreset &preset, BeatstepPresetFormat format) {
+  if (format == BEATSTEP_PRESET_BINARY) {
+    const unsigned char *bytes = (const unsigned char *)&preset;
+    return std::vector<unsigned char>(bytes, bytes + sizeof(preset));
+  }
+  nlohmann::ordered_json j = beatstepPresetToJson(preset);
+  if (format == BEATSTEP_PRESET_MSGPACK) {
+    return nlohmann::ordered_json::to_msgpack(j);
+  }
+  if (format == BEATSTEP_PRESET_CBOR) {
+    return nlohmann::ordered_json::to_cbor(j);
+  }
+  std::string text = j.dump(2) + "\n";
+  return std::vector<unsigned char>(text.begin(), text.end());
+}
+
+inline nlohmann::json::input_format_t beatstepSaxFormat (BeatstepPresetFormat format) {
+  if (format == BEATSTEP_PRESET_MSGPACK) {
+    return nlohmann::json::input_format_t::msgpack;
+  }
+  if (format == BEATSTEP_PRESET_CBOR) {
+    return nlohmann::json::input_format_t::cbor;
+  }
+  return nlohmann::json::input_format_t::json;
+}
+
+// turn the bytes of a file (in the given format) back into a preset
+inline BeatstepPreset beatstepDecodePreset (const unsigned char *data, size_t size, BeatstepPresetFormat format) {
+  if (format == BEATSTEP_PRESET_BINARY) {
+    BeatstepPreset preset;
+    if (size < sizeof(preset.header) || memcmp(data, BEATSTEP_PRESET_MAGIC, 4) != 0) {
+      throw std::invalid_argument("Not a binary preset");
+    }
+    memcpy(&preset.header, data, sizeof(preset.header));
+    if (preset.header.version != BEATSTEP_PRESET_VERSION) {
+      throw std::invalid_argument("Unsupported preset version " + std::to_string(preset.header.version));
+    }
+    unsigned int count = preset.header.count[0] | (preset.header.count[1] << 8);
+    if (count != BEATSTEP_PARAM_COUNT || size != sizeof(preset)) {
+      throw std::invalid_argument("Truncated preset");
+    }
+    memcpy(preset.values, data + sizeof(preset.header), sizeof(preset.values));
+    // same as the other formats: 7-bit values, or unset
+    for (size_t i = 0; i < BEATSTEP_PARAM_COUNT; i++) {
+      if (preset.values[i] > 0x7F && preset.values[i] != BEATSTEP_PRESET_UNSET) {
+        throw std::invalid_argument("Out of range: " + std::string(BEATSTEP_PARAMS[i].key) + " = " + std::to_string(preset.values[i]));
+      }
+    }
+    return preset;
+  }
+  BeatstepPresetReader reader;
+  nlohmann::json::sax_parse(data, data + size, &reader, beatstepSaxFormat(format));
+  return reader.preset;
+}
+
+// read a preset file, streaming it through the parser (so memory use doesn't grow with the file)
+inline BeatstepPreset beatstepReadPreset (std::string filename, BeatstepPresetFormat format = BEATSTEP_PRESET_AUTO) {
+  std::ifstream i(filename, std::ios::binary);
+  if (!i) {
+    throw std::invalid_argument("Could not open: " + filename);
+  }
+  if (format == BEATSTEP_PRESET_AUTO) {
+    unsigned char magic[4] = {};
+    i.read((char *)magic, sizeof(magic));
+    format = beatstepDetectPresetFormat(magic, i.gcount());
+    i.clear();
+    i.seekg(0);
+  }
+  if (format == BEATSTEP_PRESET_BINARY) {
+    // one more byte than a preset, to notice files that are too long
+    unsigned char data[sizeof(BeatstepPreset) + 1];
+    i.read((char *)data, sizeof(data));
+    return beatstepDecodePreset(data, i.gcount(), format);
+  }
+  BeatstepPresetReader reader;
+  nlohmann::json::sax_parse(i, &reader, beatstepSaxFormat(format));
+  return reader.preset;
+}
+
+// put a file in place of another, so anyone reading it sees either the old one or the new one
+inline void beatstepReplaceFile (std::string from, std::string to) {
+#if defined(WIN32)
+  bool ok = MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  bool ok = std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+  if (!ok) {
+    std::remove(from.c_str());
+    throw std::invalid_argument("Could not write: " + to);
+  }
+}
+
+// write a preset file (to a temporary file first, so a failed write never leaves half a preset behind)
+inline void beatstepWritePreset (std::string filename, const BeatstepPreset &preset, BeatstepPresetFormat format = BEATSTEP_PRESET_AUTO) {
+  if (format == BEATSTEP_PRESET_AUTO) {
+    format = beatstepPresetFormatFor(filename);
+  }
+  std::vector<unsigned char> data = beatstepEncodePreset(preset, format);
+  std::string temporary = filename + ".tmp";
+  {
+    std::ofstream o(temporary, std::ios::binary);
+    o.write((const char *)data.data(), data.size());
+    o.close();
+    if (!o) {
+      std::remove(temporary.c_str());
+      throw std::invalid_argument("Could not write: " + filename);
+    }
+  }
+  beatstepReplaceFile(temporary, filename);
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+// realtime scheduling for the threads that move MIDI around, and a way to see if it helps
+// everything here falls back to doing nothing where the OS (or permissions) don't allow it
+
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <atomic>
+
+// how many power-of-2 buckets a latency histogram has (the last one catches everything slower)
+#define BEATSTEP_LATENCY_BUCKETS 32
+
+#if !defined(WIN32)
+  #include <pthread.h>
+  #include <sched.h>
+  #include <sys/mman.h>
+#endif
+
+struct BeatstepRealtimeOptions {
+  bool enabled = false;
+  int priority = 60;      // SCHED_FIFO priority (1-99)
+  int cpu = -1;           // pin threads to this CPU (-1 to let the OS pick)
+  bool lockMemory = true; // keep everything in RAM, so a page-fault never stalls a reply
+};
+
+// make the calling thread realtime, as far as we're allowed
+// returns an empty string if it worked, or what went wrong
+inline std::string beatstepPromoteThread (const BeatstepRealtimeOptions &options) {
+  std::string error;
+#if defined(WIN32)
+  error = "realtime threads are not supported on this platform";
+#else
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = options.priority;
+  int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (err) {
+    error = std::string("SCHED_FIFO: ") + strerror(err);
+  }
+  #if defined(__linux__)
+  if (options.cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(options.cpu, &set);
+    err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) {
+      error += std::string(error.empty() ? "" : ", ") + "CPU " + std::to_string(options.cpu) + ": " + strerror(err);
+    }
+  }
+  #endif
+#endif
+  return error;
+}
+
+// keep the whole process in RAM
+inline std::string beatstepLockMemory () {
+#if defined(WIN32)
+  return "memory locking is not supported on this platform";
+#else
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+    return std::string("mlockall: ") + strerror(errno);
+  }
+  return "";
+#endif
+}
+
+// histogram of latencies (in microseconds, power-of-2 buckets), filled in by one thread without locking
+class BeatstepLatency {
+  public:
+    void record (double us) {
+      uint64_t whole = us < 0 ? 0 : (uint64_t)us;
+      int bucket = 0;
+      while (whole && bucket < BEATSTEP_LATENCY_BUCKETS - 1) {
+        whole >>= 1;
+        bucket++;
+      }
+      this->buckets[bucket]++;
+      this->count++;
+      this->total = this->total + us;
+      if (this->count == 1 || us < this->min) {
+        this->min = us;
+      }
+      if (us > this->max) {
+        this->max = us;
+      }
+    }
+
+    double mean () const {
+      return this->count ? this->total / this->count : 0;
+    }
+
+    // upper edge of the bucket that the p-th percentile falls in
+    double percentile (double p) const {
+      uint64_t wanted = (uint64_t)(this->count * p / 100);
+      uint64_t seen = 0;
+      for (int i = 0; i < BEATSTEP_LATENCY_BUCKETS; i++) {
+        seen += this->buckets[i];
+        if (seen > wanted) {
+          return (double)((uint64_t)1 << i);
+        }
+      }
+      return this->max;
+    }
+
+    std::atomic<uint64_t> count{0};
+    std::atomic<double> total{0};
+    std::atomic<double> min{0};
+    std::atomic<double> max{0};
+    std::atomic<uint64_t> buckets[BEATSTEP_LATENCY_BUCKETS] = {};
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <chrono>
+#include <cerrno>
+#include "BeatstepSysex.hpp"
+
+#if defined(WIN32)
+  #include <climits>
+  #include <windows.h>
+#elif defined(__APPLE__)
+  #include <dispatch/dispatch.h>
+#else
+  #include <semaphore.h>
+#endif
+
+// size of a cache-line, so the producer's and consumer's counters never share one
+#define BEATSTEP_CACHE_LINE 64
+
+// how many sysex messages / channel-messages can be waiting between the MIDI thread and the dispatcher
+#define BEATSTEP_SYSEX_SLOTS 128
+#define BEATSTEP_EVENT_SLOTS 1024
+
+// a sysex message waiting in a ring
+struct BeatstepSysexSlot {
+  std::chrono::steady_clock::time_point stamp; // when it came off the transport
+  size_t size;
+  unsigned char bytes[BEATSTEP_PARSER_MAX];
+};
+
+// a channel-message (note, cc, etc) waiting in a ring
+struct BeatstepEvent {
+  unsigned char size;
+  unsigned char bytes[3];
+  double deltatime;
+};
+
+// fixed-size, lock-free ring for exactly one producer thread and one consumer thread
+// slots are filled and read in place, so nothing is allocated or copied twice
+template <typename T, size_t N>
+class BeatstepRing {
+  static_assert((N & (N - 1)) == 0, "ring size must be a power of 2");
+
+  public:
+    // producer: the next free slot to fill in, or nullptr if the ring is full (which is counted)
+    T *claim () {
+      size_t head = this->head.load(std::memory_order_relaxed);
+      if (head - this->tail.load(std::memory_order_acquire) >= N) {
+        this->overflows.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+      }
+      return &this->slots[head & (N - 1)];
+    }
+
+    // producer: hand the claimed slot to the consumer
+    void publish () {
+      size_t head = this->head.load(std::memory_order_relaxed) + 1;
+      this->head.store(head, std::memory_order_release);
+      size_t used = head - this->tail.load(std::memory_order_relaxed);
+      if (used > this->highWater.load(std::memory_order_relaxed)) {
+        this->highWater.store(used, std::memory_order_relaxed);
+      }
+    }
+
+    // consumer: the oldest filled slot, or nullptr if there's nothing waiting
+    T *front () {
+      size_t tail = this->tail.load(std::memory_order_relaxed);
+      if (tail == this->head.load(std::memory_order_acquire)) {
+        return nullptr;
+      }
+      return &this->slots[tail & (N - 1)];
+    }
+
+    // consumer: done with the front slot, so the producer can have it back
+    void release () {
+      this->tail.store(this->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    bool empty () const {
+      return this->tail.load(std::memory_order_relaxed) == this->head.load(std::memory_order_acquire);
+    }
+
+    static constexpr size_t capacity () {
+      return N;
+    }
+
+    // messages thrown away because the ring was full, and the most that were ever waiting at once
+    std::atomic<unsigned long> overflows{0};
+    std::atomic<size_t> highWater{0};
+
+  private:
+    char padStart[BEATSTEP_CACHE_LINE];
+    std::atomic<size_t> head{0};
+    char padHead[BEATSTEP_CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail{0};
+    char padTail[BEATSTEP_CACHE_LINE - sizeof(std::atomic<size_t>)];
+    T slots[N];
+};
+
+// a counting semaphore, for a producer to wake a sleeping consumer without taking a lock
+// (posting is an atomic add, and a syscall only if someone's asleep: a futex on Linux, libdispatch on macOS)
+class BeatstepSemaphore {
+  public:
+    BeatstepSemaphore () {
+#if defined(WIN32)
+      this->handle = CreateSemaphore(nullptr, 0, LONG_MAX, nullptr);
+#elif defined(__APPLE__)
+      this->handle = dispatch_semaphore_create(0);
+#else
+      sem_init(&this->handle, 0, 0);
+#endif
+    }
+
+    ~BeatstepSemaphore () {
+#if defined(WIN32)
+      CloseHandle(this->handle);
+#elif defined(__APPLE__)
+      dispatch_release(this->handle);
+#else
+      sem_destroy(&this->handle);
+#endif
+    }
+
+    BeatstepSemaphore (const BeatstepSemaphore &) = delete;
+    BeatstepSemaphore &operator= (const BeatstepSemaphore &) = delete;
+
+    void post () {
+#if defined(WIN32)
+      ReleaseSemaphore(this->handle, 1, nullptr);
+#elif defined(__APPLE__)
+      dispatch_semaphore_signal(this->handle);
+#else
+      sem_post(&this->handle);
+#endif
+    }
+
+    // block until there's been a post (each post lets one wait through)
+    void wait () {
+#if defined(WIN32)
+      WaitForSingleObject(this->handle, INFINITE);
+#elif defined(__APPLE__)
+      dispatch_semaphore_wait(this->handle, DISPATCH_TIME_FOREVER);
+#else
+      while (sem_wait(&this->handle) != 0 && errno == EINTR) {
+      }
+#endif
+    }
+
+  private:
+#if defined(WIN32)
+    HANDLE handle;
+#elif defined(__APPLE__)
+    dispatch_semaphore_t handle;
+#else
+    sem_t handle;
+#endif
+};
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// every Arturia param-message starts with these bytes
+static constexpr unsigned char BEATSTEP_ARTURIA_HEADER[] = {0xF0, 0x00, 0x20, 0x6B, 0x7F, 0x42};
+
+// longest reply we ever wait on (the identity-reply)
+#define BEATSTEP_REPLY_MAX 17
+
+// longest sysex the parser will put back together from pieces (longer ones are dropped)
+#define BEATSTEP_PARSER_MAX 256
+
+// a sysex message with a size known up front, so it can live on the stack
+template <size_t N>
+struct BeatstepFrame {
+  unsigned char bytes[N];
+
+  const unsigned char *data () const {
+    return this->bytes;
+  }
+
+  static constexpr size_t size () {
+    return N;
+  }
+};
+
+// ask the device for a param-value
+constexpr BeatstepFrame<11> beatstepGetFrame (unsigned char cc, unsigned char pp) {
+  BeatstepFrame<11> f = {};
+  for (size_t i = 0; i < sizeof(BEATSTEP_ARTURIA_HEADER); i++) {
+    f.bytes[i] = BEATSTEP_ARTURIA_HEADER[i];
+  }
+  f.bytes[6] = 0x01;
+  f.bytes[7] = 0x00;
+  f.bytes[8] = pp;
+  f.bytes[9] = cc;
+  f.bytes[10] = 0xF7;
+  return f;
+}
+
+// set a param-value on the device (this is also how the device answers a get)
+constexpr BeatstepFrame<12> beatstepSetFrame (unsigned char cc, unsigned char pp, unsigned char vv) {
+  BeatstepFrame<12> f = {};
+  for (size_t i = 0; i < sizeof(BEATSTEP_ARTURIA_HEADER); i++) {
+    f.bytes[i] = BEATSTEP_ARTURIA_HEADER[i];
+  }
+  f.bytes[6] = 0x02;
+  f.bytes[7] = 0x00;
+  f.bytes[8] = pp;
+  f.bytes[9] = cc;
+  f.bytes[10] = vv;
+  f.bytes[11] = 0xF7;
+  return f;
+}
+
+// universal identity-request, which the device answers with its firmware version
+static constexpr BeatstepFrame<6> BEATSTEP_IDENTITY_REQUEST = {{0xF0, 0x7E, 0x7F, 0x06, 0x01, 0xF7}};
+
+// the fixed bytes of a message (where mask is 0xFF), so a whole prefix can be checked at once
+struct BeatstepPattern {
+  unsigned char value[16];
+  unsigned char mask[16];
+  size_t size;
+};
+
+// F0 00 20 6B 7F 42 02 00 pp cc vv F7
+static constexpr BeatstepPattern BEATSTEP_PARAM_REPLY = {
+  {0xF0, 0x00, 0x20, 0x6B, 0x7F, 0x42, 0x02, 0x00, 0x00, 0x00, 0x00, 0xF7},
+  {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0xFF},
+  12
+};
+
+// F0 7E 00 06 02 00 20 6B 02 00 06 00 v3 v2 v1 v0 F7
+static constexpr BeatstepPattern BEATSTEP_IDENTITY_REPLY = {
+  {0xF0, 0x7E, 0x00, 0x06, 0x02, 0x00, 0x20, 0x6B, 0x02, 0x00, 0x06, 0x00},
+  {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF},
+  17
+};
+
+// check a whole message against a pattern, with two masked 64-bit compares instead of byte-by-byte
+inline bool beatstepMatches (const BeatstepPattern &pattern, const unsigned char *data, size_t size) {
+  if (size != pattern.size || data[size - 1] != 0xF7) {
+    return false;
+  }
+  uint64_t d[2] = {0, 0};
+  uint64_t v[2];
+  uint64_t m[2];
+  memcpy(d, data, size < 16 ? size : 16);
+  memcpy(v, pattern.value, 16);
+  memcpy(m, pattern.mask, 16);
+  return (((d[0] ^ v[0]) & m[0]) | ((d[1] ^ v[1]) & m[1])) == 0;
+}
+
+// pulls whole sysex messages out of a stream of MIDI bytes, however it was split up or run together
+// channel-messages in between are skipped, and realtime bytes inside a sysex are ignored
+class BeatstepParser {
+  public:
+    // calls onFrame(data, size) for every complete sysex message
+    // a message that arrived in one piece is passed straight from data, without copying
+    template <typename F>
+    void feed (const unsigned char *data, size_t size, F onFrame) {
+      size_t i = 0;
+      while (i < size) {
+        if (!this->inFrame) {
+          const unsigned char *start = (const unsigned char *)memchr(data + i, 0xF0, size - i);
+          if (!start) {
+            return;
+          }
+          i = start - data;
+
+          // whole message is in this chunk? hand it over where it is
+          size_t j = i + 1;
+          while (j < size && data[j] < 0x80) {
+            j++;
+          }
+          if (j < size && data[j] == 0xF7) {
+            onFrame(data + i, j - i + 1);
+            i = j + 1;
+            continue;
+          }
+          if (j < size && data[j] < 0xF8) {
+            // cut off by another status-byte: this one is never finishing
+            this->dropped++;
+            i = j;
+            continue;
+          }
+
+          // runs past the end of the chunk (or has realtime bytes in it): collect it
+          this->inFrame = true;
+          this->length = 0;
+        }
+
+        unsigned char b = data[i];
+        if (b >= 0xF8) {
+          // realtime bytes can show up anywhere
+          i++;
+          continue;
+        }
+        if (b >= 0x80 && b != 0xF7 && !(b == 0xF0 && this->length == 0)) {
+          // a new status-byte cut this message off (leave it for the next round)
+          this->inFrame = false;
+          this->dropped++;
+          continue;
+        }
+        if (this->length < BEATSTEP_PARSER_MAX) {
+          this->buffer[this->length] = b;
+        }
+        this->length++;
+        i++;
+        if (b == 0xF7) {
+          this->inFrame = false;
+          if (this->length <= BEATSTEP_PARSER_MAX) {
+            onFrame(this->buffer, this->length);
+          } else {
+            this->dropped++;
+          }
+        }
+      }
+    }
+
+    // messages thrown away because they were cut off or too long
+    unsigned long dropped = 0;
+
+  private:
+    bool inFrame = false;
+    size_t length = 0;
+    unsigned char buffer[BEATSTEP_PARSER_MAX];
+};
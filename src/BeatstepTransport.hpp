@@ -0,0 +1,115 @@
+#pragma once
+
+#include "RtMidi.h"
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+// where bytes to & from the device go
+// receivers get one MIDI message at a time (or a piece of a long sysex), on the transport's own thread
+class BeatstepTransport {
+  public:
+    typedef void (*Receiver) (double deltatime, const unsigned char *data, size_t size, void *userData);
+
+    virtual ~BeatstepTransport () {}
+
+    virtual unsigned int portCount () = 0;
+    virtual std::string portName (unsigned int port) = 0;
+
+    // connect to a device, in and out
+    virtual void openPort (unsigned int port) = 0;
+
+    // make a port other programs can connect to
+    virtual void openVirtualPort (std::string name) = 0;
+
+    // send bytes (can be several messages back-to-back, which a transport sends in as few writes as it can)
+    virtual void send (const unsigned char *data, size_t size) = 0;
+
+    // set who gets incoming messages (do this before opening a port)
+    virtual void setReceiver (Receiver receiver, void *userData) = 0;
+
+    // stop taking incoming messages: once this returns, the receiver isn't running and won't be called again
+    // (sending still works, until the transport is deleted)
+    virtual void stopInput () = 0;
+};
+
+// the default transport, which works everywhere RtMidi does
+class BeatstepRtMidiTransport : public BeatstepTransport {
+  public:
+    BeatstepRtMidiTransport () {
+      try {
+        this->midiout = new RtMidiOut();
+        this->midiin = new RtMidiIn();
+      } catch ( RtMidiError &error ) {
+        error.printMessage();
+        exit( EXIT_FAILURE );
+      }
+    }
+
+    ~BeatstepRtMidiTransport () {
+      delete this->midiin;
+      delete this->midiout;
+    }
+
+    unsigned int portCount () {
+      return this->midiout->getPortCount();
+    }
+
+    std::string portName (unsigned int port) {
+      return this->midiout->getPortName(port);
+    }
+
+    void openPort (unsigned int port) {
+      this->midiout->openPort(port);
+      this->midiin->openPort(port);
+      this->midiin->ignoreTypes(false, false, false);
+    }
+
+    void openVirtualPort (std::string name) {
+      this->midiout->openVirtualPort(name);
+      this->midiin->openVirtualPort(name);
+      this->midiin->ignoreTypes(false, false, false);
+    }
+
+    // RtMidi before 5.0 (on ALSA, at least) only sends the first of several messages given at once, and drops
+    // the rest, so back-to-back sysex frames go out one sendMessage each
+    void send (const unsigned char *data, size_t size) {
+      size_t start = 0;
+      while (start < size) {
+        size_t end = size;
+        if (data[start] == 0xF0) {
+          const unsigned char *last = (const unsigned char *)memchr(data + start, 0xF7, size - start);
+          if (last) {
+            end = last - data + 1;
+          }
+        }
+        this->midiout->sendMessage(data + start, end - start);
+        start = end;
+      }
+    }
+
+    void setReceiver (Receiver receiver, void *userData) {
+      this->receiver = receiver;
+      this->userData = userData;
+      this->midiin->setCallback(&BeatstepRtMidiTransport::forward, this);
+    }
+
+    // closing the port joins RtMidi's input thread, so a callback that's under way finishes first
+    void stopInput () {
+      this->midiin->closePort();
+      this->midiin->cancelCallback();
+    }
+
+    RtMidiOut *midiout;
+    RtMidiIn *midiin;
+
+  private:
+    static void forward (double deltatime, std::vector<unsigned char> *message, void *userData) {
+      BeatstepRtMidiTransport *self = (BeatstepRtMidiTransport *)userData;
+      self->receiver(deltatime, message->data(), message->size(), self->userData);
+    }
+
+    Receiver receiver = nullptr;
+    void *userData = nullptr;
+};
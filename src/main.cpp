@@ -1,6 +1,17 @@
 #include <iostream>
 #include <cstdlib>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <iomanip>
+#include <sstream>
+#include <memory>
 #include "BeatStep.hpp"
+#include "BeatstepEmulator.hpp"
+#ifdef BEATSTEP_ALSA
+#include "BeatstepAlsaTransport.hpp"
+#endif
 
 #include "CLI/App.hpp"
 #include "CLI/Formatter.hpp"
@@ -8,12 +19,165 @@
 
 BeatStep* bs;
 
-void emulate_callback (double deltatime, std::vector< unsigned char > *message, void *userData) {
-  unsigned int nBytes = message->size();
-  for ( unsigned int i=0; i<nBytes; i++ )
-    std::cout << "Byte " << i << " = " << (int)message->at(i) << ", ";
-  if ( nBytes > 0 )
-    std::cout << "stamp = " << deltatime << std::endl;
+#ifdef BEATSTEP_COUNT_ALLOCATIONS
+// heap allocations made on any thread (bench/allocations.cpp, only in the beatstep-bench build)
+extern std::atomic<unsigned long> beatstepAllocations;
+#endif
+
+// name, or name with -2, -3, etc before its extension for the devices after the first
+std::string numberedName (std::string name, unsigned int i) {
+  if (i == 0) {
+    return name;
+  }
+  size_t dot = name.find_last_of('.');
+  size_t slash = name.find_last_of("/\\");
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = name.size();
+  }
+  return name.substr(0, dot) + "-" + std::to_string(i + 1) + name.substr(dot);
+}
+
+// make the transport asked for on the command-line
+BeatstepTransport* makeTransport (std::string name) {
+  if (name == "alsa") {
+#ifdef BEATSTEP_ALSA
+    return new BeatstepAlsaTransport();
+#else
+    std::cerr << "This build doesn't have ALSA support." << std::endl;
+    exit(EXIT_FAILURE);
+#endif
+  }
+  return new BeatstepRtMidiTransport();
+}
+
+// print a capture, one message per line: seconds since it started, device, direction, bytes, and what it means
+void decode (std::string filename) {
+  std::ostringstream lines;
+  BeatstepCaptureHeader header = beatstepReadCapture(filename, [&lines] (uint64_t time, BeatstepCaptureDirection direction, unsigned char port, const unsigned char *data, size_t size) {
+    char stamp[32];
+    snprintf(stamp, sizeof(stamp), "%12.6f %3d %-3s ", time / 1e9, port + 1, direction <= BEATSTEP_CAPTURE_OUT ? BEATSTEP_CAPTURE_DIRECTION_NAMES[direction] : "?");
+    lines << stamp;
+    for (size_t i = 0; i < size; i++) {
+      char hex[4];
+      snprintf(hex, sizeof(hex), "%02X ", data[i]);
+      lines << hex;
+    }
+    lines << " " << beatstepDescribe(data, size) << '\n';
+  });
+  std::time_t start = beatstepGetLE(header.started, 8) / 1000000000;
+  char when[32];
+  std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", std::localtime(&start));
+  std::cout << "capture started " << when << ", recorded by " << (header.flags & BEATSTEP_CAPTURE_HOST ? "the host (out is to the device)" : "an emulator (out is from the device)") << '\n' << lines.str() << std::flush;
+}
+
+// run a loop of get/set pairs on an open device, and print how it went
+void bench (BeatStep* b, unsigned int iterations, bool async) {
+  // one round first, so buffers are already sized
+  unsigned char v = b->get(0x70, 0x03);
+  b->set(0x70, 0x03, v);
+  std::vector<double> trips(iterations);
+
+#ifdef BEATSTEP_COUNT_ALLOCATIONS
+  unsigned long before = beatstepAllocations;
+#endif
+  auto start = std::chrono::steady_clock::now();
+  if (async) {
+    // queue everything up front, then collect the results
+    std::vector<std::future<unsigned char>> reads;
+    for (unsigned int i = 0; i < iterations; i++) {
+      b->setAsync(0x70, 0x03, v);
+      reads.push_back(b->getAsync(0x70, 0x03));
+    }
+    for (std::future<unsigned char> &r : reads) {
+      r.get();
+    }
+  } else {
+    for (unsigned int i = 0; i < iterations; i++) {
+      auto sent = std::chrono::steady_clock::now();
+      unsigned char r = b->get(0x70, 0x03);
+      trips[i] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count();
+      b->set(0x70, 0x03, r);
+    }
+  }
+  std::chrono::duration<double, std::micro> took = std::chrono::steady_clock::now() - start;
+#ifdef BEATSTEP_COUNT_ALLOCATIONS
+  unsigned long made = beatstepAllocations - before;
+#endif
+
+  std::cout << iterations << " get/set pairs in " << took.count() / 1000 << "ms (" << took.count() / iterations << "us each)" << std::endl;
+  if (!async && iterations) {
+    std::sort(trips.begin(), trips.end());
+    double total = 0;
+    for (double t : trips) {
+      total += t;
+    }
+    std::cout << "get round-trip: min " << trips.front() << "us, avg " << total / iterations << "us, p99 " << trips[iterations * 99 / 100] << "us, max " << trips.back() << "us" << std::endl;
+  }
+#ifdef BEATSTEP_COUNT_ALLOCATIONS
+  std::cout << made << " heap allocations (on any thread, the MIDI library's included)" << std::endl;
+#else
+  std::cout << "heap allocations: not counted (build beatstep-bench for that)" << std::endl;
+#endif
+  std::cout << "replies ring: high-water " << b->replies.highWater << "/" << b->replies.capacity() << ", " << b->replies.overflows << " overflows" << std::endl;
+  std::cout << "events ring: high-water " << b->events.highWater << "/" << b->events.capacity() << ", " << b->events.overflows << " overflows" << std::endl;
+  BeatstepLatency &l = b->dispatchLatency;
+  std::cout << "dispatch latency: min " << l.min << "us, avg " << l.mean() << "us, p99 <= " << l.percentile(99) << "us, max " << l.max << "us (" << l.count << " replies)" << std::endl;
+  std::cout << "realtime: " << b->realtimeStatus() << std::endl;
+}
+
+// time encoding/decoding one preset, and a corpus of them, in every preset format (no device needed)
+void benchFormats (unsigned int iterations, unsigned int corpusSize) {
+  typedef std::chrono::steady_clock clock;
+  std::mt19937 random(1);
+  std::vector<BeatstepPreset> corpus(corpusSize ? corpusSize : 1);
+  for (BeatstepPreset &preset : corpus) {
+    preset = beatstepEmptyPreset();
+    for (unsigned char &v : preset.values) {
+      v = random() % 0x80;
+    }
+  }
+
+  std::cout << "format     size  encode      decode      | " << corpus.size() << " presets: size        encode      decode" << std::endl;
+  for (int f = BEATSTEP_PRESET_JSON; f <= BEATSTEP_PRESET_CBOR; f++) {
+    BeatstepPresetFormat format = (BeatstepPresetFormat)f;
+
+    // one preset, many times
+    std::vector<unsigned char> data;
+    auto start = clock::now();
+    for (unsigned int i = 0; i < iterations; i++) {
+      data = beatstepEncodePreset(corpus[0], format);
+    }
+    std::chrono::duration<double, std::micro> encode = clock::now() - start;
+    start = clock::now();
+    for (unsigned int i = 0; i < iterations; i++) {
+      beatstepDecodePreset(data.data(), data.size(), format);
+    }
+    std::chrono::duration<double, std::micro> decode = clock::now() - start;
+
+    // the whole corpus, once
+    std::vector<std::vector<unsigned char>> files;
+    files.reserve(corpus.size());
+    size_t total = 0;
+    start = clock::now();
+    for (const BeatstepPreset &preset : corpus) {
+      files.push_back(beatstepEncodePreset(preset, format));
+      total += files.back().size();
+    }
+    std::chrono::duration<double, std::milli> corpusEncode = clock::now() - start;
+    start = clock::now();
+    for (const std::vector<unsigned char> &file : files) {
+      beatstepDecodePreset(file.data(), file.size(), format);
+    }
+    std::chrono::duration<double, std::milli> corpusDecode = clock::now() - start;
+
+    std::cout << std::left << std::setw(8) << BEATSTEP_PRESET_FORMAT_NAMES[f] << std::right
+      << std::setw(6) << data.size() << "  "
+      << std::setw(8) << encode.count() / iterations << "us  "
+      << std::setw(8) << decode.count() / iterations << "us  | "
+      << std::setw(12) << total << "B  "
+      << std::setw(8) << corpusEncode.count() << "ms  "
+      << std::setw(8) << corpusDecode.count() << "ms" << std::endl;
+  }
 }
 
 int main(int argc, char *argv[]) {
@@ -23,15 +187,56 @@ int main(int argc, char *argv[]) {
   int device = 1;
   std::string filename;
 
+  std::string transport = "rtmidi";
+
   app.add_option("-d,--device", device, "The device to use (see list)");
+  app.add_option("-t,--transport", transport, "How to talk to MIDI (rtmidi, alsa)")->check(CLI::IsMember({"rtmidi", "alsa"}));
+
+  BeatstepRealtimeOptions realtime;
+  app.add_flag("-r,--realtime", realtime.enabled, "Run MIDI threads with realtime priority (falls back if not allowed)");
+  app.add_option("--priority", realtime.priority, "Realtime priority to use (1-99)");
+  app.add_option("--cpu", realtime.cpu, "Pin MIDI threads to this CPU");
+  std::string recordDir;
+  app.add_option("--record", recordDir, "Record everything sent to & received from the device, to a timestamped capture file in this directory (see decode, emulate --replay)");
 
   auto subList = app.add_subcommand("list", "List available MIDI devices");
   
+  unsigned int window = 16;
+  bool diff = false;
+  std::string format;
+  auto formats = CLI::IsMember({"json", "binary", "msgpack", "cbor"});
+  std::string only;
+  std::string maskFile;
+  bool fresh = false;
+  std::string freshHelp = "Ask the device, instead of using values cached from earlier runs";
   auto subLoad = app.add_subcommand("load", "Load a .beatstep preset file on device");
   subLoad->add_option("FILE", filename, "The .beatstep file")->required();
+  subLoad->add_flag("--diff", diff, "Read the device first, and only write values that are different");
+  subLoad->add_option("-w,--window", window, "How many reads to keep in flight at once (with --diff)");
+  subLoad->add_option("-f,--format", format, "File format (json, binary, msgpack, cbor), instead of detecting it")->check(formats);
+  subLoad->add_option("--only", only, "Just these params: groups (knobs, transport, pads, globals), keys (112_3) or ranges (0x70-0x7F:3)");
+  subLoad->add_option("--mask", maskFile, "Just the params listed in this file (same items as --only, one per line)");
+  bool verify = false;
+  subLoad->add_flag("--verify", verify, "Read back everything written, and write again whatever didn't stick");
+  unsigned int sample = 0;
+  subLoad->add_flag("--fresh", fresh, freshHelp);
+  subLoad->add_option("--verify-sample", sample, "Read back just this many written values (spread over the preset), and everything only if one is wrong");
 
   auto subSave = app.add_subcommand("save", "Save a .beatstep preset file from device");
   subSave->add_option("FILE", filename, "The .beatstep file")->required();
+  subSave->add_option("-w,--window", window, "How many reads to keep in flight at once");
+  subSave->add_option("-f,--format", format, "File format (json, binary, msgpack, cbor), instead of going by the filename")->check(formats);
+  bool resume = false;
+  subSave->add_flag("--resume", resume, "Finish a save that didn't get every value, from FILE.partial");
+  subSave->add_option("--only", only, "Just these params: groups (knobs, transport, pads, globals), keys (112_3) or ranges (0x70-0x7F:3)");
+  subSave->add_option("--mask", maskFile, "Just the params listed in this file (same items as --only, one per line)");
+  subSave->add_flag("--fresh", fresh, freshHelp);
+
+  std::string output;
+  auto subConvert = app.add_subcommand("convert", "Convert a preset file between formats");
+  subConvert->add_option("FILE", filename, "The preset file to read (any format)")->required();
+  subConvert->add_option("OUTPUT", output, "The preset file to write (.bsp, .msgpack, .cbor, or JSON for anything else)")->required();
+  subConvert->add_option("-f,--format", format, "Output format (json, binary, msgpack, cbor), instead of going by the filename")->check(formats);
 
   // auto subUpdate = app.add_subcommand("update", "Install a .led firmware file on device");
   // subUpdate->add_option("-d,--device", device, "The device to use (see list)");
@@ -52,30 +257,99 @@ int main(int argc, char *argv[]) {
 
   auto subGet = app.add_subcommand("get", "Get a param-value");
   subGet->add_flag("-i,--int", intOut, "Output decimal value, instead of hex");
-  subGet->add_option("PROGRAM", pp, "The number of the program")->required();
-  subGet->add_option("CONTROL", cc, "The number of the control")->required();
+  subGet->add_flag("--fresh", fresh, freshHelp);
+  subGet->add_option("PROGRAM", pp, "The number of the program")->required()->check(CLI::Range(0, 0x7F));
+  subGet->add_option("CONTROL", cc, "The number of the control")->required()->check(CLI::Range(0, 0x7F));
 
   auto subSet = app.add_subcommand("set", "Set a param-value");
-  subSet->add_option("PROGRAM", pp, "The number of the program")->required();
-  subSet->add_option("CONTROL", cc, "The number of the control")->required();
-  subSet->add_option("VALUE", vv, "The number of the value to set")->required();
+  subSet->add_option("PROGRAM", pp, "The number of the program")->required()->check(CLI::Range(0, 0x7F));
+  subSet->add_option("CONTROL", cc, "The number of the control")->required()->check(CLI::Range(0, 0x7F));
+  subSet->add_option("VALUE", vv, "The number of the value to set")->required()->check(CLI::Range(0, 0x7F));
+
+  auto subPace = app.add_subcommand("pace", "Find (and remember) how fast the device can take writes");
+
+  unsigned int iterations = 1000;
+  auto subBench = app.add_subcommand("bench", "Time a loop of reads & writes on the device");
+  bool async = false;
+  subBench->add_option("-n,--iterations", iterations, "How many get/set pairs to run");
+  subBench->add_flag("-a,--async", async, "Queue everything with setAsync/getAsync, instead of one at a time");
+  bool compare = false;
+  subBench->add_flag("-c,--compare", compare, "Run on every transport, one after the other, on the same port");
+  bool emulated = false;
+  subBench->add_flag("-e,--emulated", emulated, "With --compare, run against an emulator started here, instead of a device (so only the transports differ)");
+  bool benchFormat = false;
+  unsigned int corpus = 10000;
+  subBench->add_flag("--formats", benchFormat, "Time preset encoding & decoding in each file format, instead (no device needed)");
+  subBench->add_option("--corpus", corpus, "How many presets to encode & decode as a corpus (with --formats)");
 
   auto subEmu = app.add_subcommand("emulate", "Emulate a beatstep (for debugging)");
+  std::string emuName = "Arturia BeatStep";
+  std::string firmware;
+  std::string stateFile;
+  bool reset = false;
+  std::string captureDir;
+  subEmu->add_option("-n,--name", emuName, "Name of the virtual port");
+  subEmu->add_option("--firmware", firmware, "Firmware version to report (like 1.0.4.2)");
+  subEmu->add_option("--state", stateFile, "Keep the emulated memory in this file between runs (default is in the cache dir)");
+  subEmu->add_flag("--reset", reset, "Start with empty memory, instead of what the state file has");
+  subEmu->add_option("-c,--capture", captureDir, "Record every message in & out, to a timestamped capture file in this directory (see decode)");
+  std::vector<std::string> profiles;
+  subEmu->add_option("-p,--profile", profiles, "Misbehave like a real device: ideal, usb, hub or flaky, and/or settings (latency, jitter, shape, drop, reorder, hold, rate, burst, seed) like hub,drop=0.05,seed=7 (give several to take turns between devices)");
+  unsigned int count = 1;
+  std::string replayFile;
+  double speed = 1;
+  subEmu->add_option("--replay", replayFile, "Answer requests exactly as the device in this capture did (from --record or emulate --capture)");
+  subEmu->add_option("--speed", speed, "With --replay, how many times faster than recorded to answer (0 is no waiting)")->check(CLI::NonNegativeNumber);
+  subEmu->add_option("--count", count, "How many devices to emulate (each with its own port, memory & state file)")->check(CLI::Range(1, 128));
 
 
+  auto subDecode = app.add_subcommand("decode", "Print a capture file made by emulate --capture");
+  subDecode->add_option("FILE", filename, "The capture file")->required();
+
   CLI11_PARSE(app, argc, argv);
 
-  bs = new BeatStep();
+  std::unique_ptr<BeatstepCaptureWriter> recording;
+  if (!recordDir.empty()) {
+    recording.reset(new BeatstepCaptureWriter(beatstepCaptureName(recordDir), BEATSTEP_CAPTURE_HOST));
+  }
+
+  bs = new BeatStep(makeTransport(transport));
+  bs->setRealtime(realtime);
+  bs->setCapture(recording.get());
 
   if (app.got_subcommand(subList)) {
     bs->list();
     return 0;
   }
 
+  BeatstepPresetFormat presetFormat = format.empty() ? BEATSTEP_PRESET_AUTO : beatstepPresetFormatNamed(format);
+
+  BeatstepMask mask = BEATSTEP_MASK_ALL;
+  if (!only.empty() || !maskFile.empty()) {
+    mask = (only.empty() ? BeatstepMask() : beatstepParseMask(only)) | (maskFile.empty() ? BeatstepMask() : beatstepReadMask(maskFile));
+  }
+
+  if (app.got_subcommand(subConvert)) {
+    beatstepWritePreset(output, beatstepReadPreset(filename), presetFormat);
+    std::cout << "OK" << std::endl;
+    return 0;
+  }
+
+  if (app.got_subcommand(subDecode)) {
+    decode(filename);
+    return 0;
+  }
+
+  if (app.got_subcommand(subBench) && benchFormat) {
+    benchFormats(iterations, corpus);
+    return 0;
+  }
+
   bool n = true;
 
   if (app.got_subcommand(subColor)) {
     bs->openPort(device - 1);
+    bs->loadPace();
     BeatstepColor c = BEATSTEP_COLORS_OFF;
     if (color == "red") {
       c = BEATSTEP_COLORS_RED;
@@ -87,6 +361,7 @@ int main(int argc, char *argv[]) {
       c = BEATSTEP_COLORS_BLUE;
     }
     bs->color(0x70 + led, c);
+    bs->saveShadow();
     std::cout << "OK" << std::endl;
   } else if (app.got_subcommand(subFw)) {
     bs->openPort(device - 1);
@@ -94,7 +369,14 @@ int main(int argc, char *argv[]) {
     std::cout << (int)v[0] << '.' << (int)v[1] << '.' << (int)v[2] << '.' << (int)v[3] << std::endl;
   } else if (app.got_subcommand(subGet)) {
     bs->openPort(device - 1);
-    int r = bs->get(pp, cc);
+    // a recently-checked cache, or one read (checking a cache costs more reads than that)
+    int r;
+    if (!fresh && bs->loadShadow(false)) {
+      r = bs->getCached(pp, cc);
+    } else {
+      r = bs->get(pp, cc);
+    }
+    bs->saveShadow();
     if (intOut) {
       std::cout << r << std::endl;
     } else {
@@ -102,23 +384,180 @@ int main(int argc, char *argv[]) {
     }
   } else if (app.got_subcommand(subSet)) {
     bs->openPort(device - 1);
+    bs->loadPace();
     bs->set(pp, cc, vv);
+    bs->saveShadow();
     std::cout << "OK" << std::endl;
   } else if (app.got_subcommand(subLoad)) {
     bs->openPort(device - 1);
-    n = bs->loadPreset(filename);
-    std::cout << "OK" << std::endl;
+    bs->loadPace();
+    if (diff && !fresh) {
+      bs->loadShadow();
+    }
+    n = bs->loadPreset(filename, diff, window, presetFormat, mask, verify || sample, sample);
+    bs->saveShadow();
+    if (diff) {
+      std::cout << bs->lastLoad.written << " written, " << bs->lastLoad.skipped << " skipped (already set)" << std::endl;
+    }
+    bool sampledOnly = bs->lastLoad.sampled && !bs->lastLoad.escalated;
+    if (bs->lastLoad.sampled) {
+      unsigned int total = bs->lastVerify.size();
+      if (bs->lastLoad.escalated) {
+        std::cout << "sampled " << bs->lastLoad.sampled << " of " << total << ", found a mismatch, so verified everything" << std::endl;
+      } else {
+        std::cout << "sampled " << bs->lastLoad.sampled << " of " << total << ", all matched: at " << BEATSTEP_VERIFY_CONFIDENCE * 100 << "% confidence, at most "
+          << bs->lastLoad.bound << " of the " << total << " writes (" << 100.0 * bs->lastLoad.bound / total << "%) are wrong" << std::endl;
+      }
+    }
+    if ((verify || sample) && !sampledOnly) {
+      for (const BeatstepVerifyResult &r : bs->lastVerify) {
+        if (r.tries > 1 || !r.ok) {
+          std::cout << (int)r.setting.cc << ":" << (int)r.setting.pp << " wrote " << (int)r.setting.value;
+          if (!r.answered) {
+            std::cout << ", no response";
+          } else {
+            std::cout << ", read " << (int)r.got;
+          }
+          std::cout << " (" << r.tries << (r.tries == 1 ? " try" : " tries") << ")" << (r.ok ? "" : " FAILED") << std::endl;
+        }
+      }
+      std::cout << bs->lastVerify.size() - bs->lastLoad.failed << " verified, " << bs->lastLoad.retried << " retried, " << bs->lastLoad.failed << " failed" << std::endl;
+    }
+    std::cout << (n ? "OK" : "FAILED") << std::endl;
   } else if (app.got_subcommand(subSave)) {
     bs->openPort(device - 1);
-    n = bs->savePreset(filename);
+    if (!fresh) {
+      bs->loadShadow();
+    }
+    n = bs->savePreset(filename, window, presetFormat, resume, mask);
+    bs->saveShadow();
+    if (bs->lastSave.skipped) {
+      std::cout << bs->lastSave.read << " read, " << bs->lastSave.skipped << " from the cache (--fresh to read everything)" << std::endl;
+    }
     std::cout << "OK" << std::endl;
+  } else if (app.got_subcommand(subPace)) {
+    bs->openPort(device - 1);
+    double rate = bs->probePace();
+    bs->savePace();
+    std::cout << rate << " writes/sec" << std::endl;
+  } else if (app.got_subcommand(subBench)) {
+    if (compare) {
+      // only one of us on the port at a time
+      delete bs;
+      std::vector<std::string> transports = { "rtmidi" };
+#ifdef BEATSTEP_ALSA
+      transports.push_back("alsa");
+#endif
+      // an ideal one, with empty memory, that answers straight from its transport's thread
+      // (on ALSA, RtMidi makes a virtual port's in & out two clients, which the ALSA transport can't open as one
+      // device, so where it's built the emulator uses the ALSA transport: one port, both ways, like a real device)
+      std::unique_ptr<BeatstepEmulator> emulator;
+      std::string emulatorName = "BeatStep Bench";
+      if (emulated) {
+#ifdef BEATSTEP_ALSA
+        emulator.reset(new BeatstepEmulator(makeTransport("alsa")));
+#else
+        emulator.reset(new BeatstepEmulator(makeTransport(transport)));
+#endif
+        emulator->start(emulatorName);
+      }
+      for (std::string t : transports) {
+        bs = new BeatStep(makeTransport(t));
+        bs->setRealtime(realtime);
+        bs->setCapture(recording.get());
+        if (emulated) {
+          // each transport numbers the ports its own way
+          int found = bs->findPort(emulatorName);
+          if (found < 0) {
+            throw std::invalid_argument("Could not find the emulator's port with " + t);
+          }
+          bs->openPort(found);
+        } else {
+          bs->openPort(device - 1);
+        }
+        bs->loadPace();
+        std::cout << t << " (" << bs->portName << "):" << std::endl;
+        bench(bs, iterations, async);
+        std::cout << std::endl;
+        delete bs;
+      }
+      bs = nullptr;
+    } else {
+      bs->openPort(device - 1);
+      bs->loadPace();
+      bench(bs, iterations, async);
+    }
   } else if (app.got_subcommand(subEmu)) {
-    bs->midiout->openVirtualPort ("Arturia BeatStep");
-    bs->midiin->openVirtualPort("Arturia BeatStep");
-    bs->midiin->setCallback(&emulate_callback);
+    // the emulators have transports of their own
+    delete bs;
+    bs = nullptr;
+    unsigned char v[4];
+    if (!firmware.empty()) {
+      beatstepParseFirmware(firmware, v);
+    }
+    std::unique_ptr<BeatstepCaptureWriter> capture;
+    if (!captureDir.empty()) {
+      capture.reset(new BeatstepCaptureWriter(beatstepCaptureName(captureDir)));
+    }
 
-    std::cout << "A virtual device has been created. Press ENTER to stop." << std::endl;
+    // every emulator's delayed replies go out from one thread
+    BeatstepEmulatorLoop loop;
+    std::vector<std::unique_ptr<BeatstepEmulator>> emulators;
+    std::vector<std::unique_ptr<BeatstepReplay>> replays;
+    std::vector<std::string> names;
+    for (unsigned int i = 0; i < count; i++) {
+      BeatstepEmulator *emulator = new BeatstepEmulator(makeTransport(transport), numberedName(stateFile.empty() ? BeatStep::cachePath("emulator.bin") : stateFile, i));
+      emulators.emplace_back(emulator);
+      if (!reset) {
+        emulator->loadState();
+      }
+      if (!firmware.empty()) {
+        emulator->setFirmware(v);
+      }
+      emulator->setLoop(&loop);
+      if (capture) {
+        emulator->setCapture(capture.get(), i);
+      }
+      if (!replayFile.empty()) {
+        // each device replays the same one in a capture of several
+        replays.emplace_back(new BeatstepReplay(replayFile, i));
+        emulator->setReplay(replays.back().get(), speed);
+      }
+      // each one gets the next profile, and its own seed
+      BeatstepEmulatorProfile p = beatstepParseProfile(profiles.empty() ? "" : profiles[i % profiles.size()]);
+      p.seed += i;
+      emulator->setProfile(p);
+      names.push_back(count == 1 ? emuName : emuName + " " + std::to_string(i + 1));
+      emulator->start(names.back());
+    }
+
+    if (count == 1) {
+      std::cout << "A virtual device has been created. Press ENTER to stop." << std::endl;
+    } else {
+      std::cout << count << " virtual devices have been created (" << names.front() << " to " << names.back() << "). Press ENTER to stop." << std::endl;
+    }
     std::cin.get();
+    loop.stop();
+    for (unsigned int i = 0; i < count; i++) {
+      BeatstepEmulator *emulator = emulators[i].get();
+      emulator->stop();
+      emulator->saveState();
+      if (count > 1) {
+        std::cout << names[i] << " (" << emulator->profile.name << "): ";
+      }
+      std::cout << emulator->reads << " reads, " << emulator->writes << " writes, " << emulator->identities << " identity requests, " << emulator->ignored << " ignored";
+      if (!replayFile.empty()) {
+        std::cout << ", " << emulator->replayed << " of " << replays[i]->requests << " recorded requests replayed, " << emulator->unscripted << " not in the capture";
+      }
+      if (!profiles.empty()) {
+        std::cout << ", " << emulator->dropped << " replies dropped, " << emulator->reordered << " held back, " << emulator->limited << " messages rate-limited";
+      }
+      std::cout << std::endl;
+    }
+    if (capture) {
+      capture->close();
+      std::cout << capture->messages << " messages (" << capture->written << " bytes) captured in " << capture->filename << ", " << capture->dropped << " dropped" << std::endl;
+    }
   }
   /*
   else if (app.got_subcommand(subUpdate)) {
@@ -134,5 +573,9 @@ int main(int argc, char *argv[]) {
   */
 
   delete bs;
+  if (recording) {
+    recording->close();
+    std::cerr << recording->messages << " messages recorded in " << recording->filename << ", " << recording->dropped << " dropped" << std::endl;
+  }
   return n ? 0 : 1;
 }